@@ -68,6 +68,29 @@ graph{
     },
 };
 
+static edge_batch
+make_edge_batch(const std::vector<edge_type>& edges) {
+    assert(edges.size() && edges.size() <= batch_lanes);
+
+    edge_batch b;
+    b.size_ = edges.size();
+    for (unsigned int k = 0; k < batch_lanes; ++k) {
+        const edge_type& edge = edges[k < edges.size() ? k : 0];
+        b.types_[k] = static_cast<node_type>(edge.type_index);
+        b.ids_[k] = static_cast<transformation_id>(edge.id);
+        b.generators_.set(k, edge.transform.g0_);
+        b.permutations_[k] = edge.transform.g1_.g_;
+    }
+
+    return b;
+}
+
+const std::array<edge_batch, 2>
+batch_graph{{
+    make_edge_batch(graph.edges_[0]),
+    make_edge_batch(graph.edges_[1]),
+}};
+
 /* Upper half plane. */
 const circle c{0, -1i, 0};
 
@@ -10,6 +10,8 @@
 
 #include <cassert>
 
+#include <array>
+#include <utility>
 #include <vector>
 
 #include "circle.hpp"
@@ -17,6 +19,7 @@
 #include "permutation.hpp"
 #include "groups.hpp"
 #include "transformation_graph.hpp"
+#include "batch.hpp"
 
 namespace apollonian {
 
@@ -27,10 +30,48 @@ namespace apollonian {
  * colors around. As a small quirk of this implementation, the Mobius
  * transformation and permutation act on opposite sides.
  */
-using apollonian_transformation
-    = product_group<mobius_transformation,
+template <typename T>
+using basic_apollonian_transformation
+    = product_group<basic_mobius_transformation<T>,
                     opposite_group<permutation<4>>>;
 
+using apollonian_transformation = basic_apollonian_transformation<double>;
+
+/* A transformation known at compile time, made of a
+ * static_mobius_transformation and a static_permutation.
+ */
+template <typename Mobius, typename Permutation>
+struct static_apollonian_transformation {
+    static apollonian_transformation value();
+
+    /* Same as t*value(), in the precision of t. */
+    template <typename T>
+    static basic_apollonian_transformation<T> right_multiply(
+            const basic_apollonian_transformation<T>& t);
+};
+
+template <typename Mobius, typename Permutation>
+inline apollonian_transformation
+static_apollonian_transformation<Mobius, Permutation>::value() {
+    return {Mobius::value(), Permutation::value()};
+}
+
+template <typename Mobius, typename Permutation>
+template <typename T>
+inline basic_apollonian_transformation<T>
+static_apollonian_transformation<Mobius, Permutation>::right_multiply(
+        const basic_apollonian_transformation<T>& t)
+{
+    /* The permutations act on the opposite side. */
+    return {Mobius::right_multiply(t.g0_),
+            Permutation::left_multiply(t.g1_.g_)};
+}
+
+enum class node_type : unsigned char {
+    A = 0,  /* triangle-type */
+    B = 1,  /* circle-type */
+};
+
 namespace canonical {
 
 enum class transformation_id {
@@ -43,6 +84,11 @@ enum class transformation_id {
     P,
 };
 
+constexpr unsigned int
+edge_id(transformation_id id) {
+    return static_cast<unsigned int>(id);
+}
+
 /* These are the six tangency points involving the four circles in the
  * "canonical" Apollonian gasket.
  */
@@ -77,28 +123,117 @@ extern const apollonian_transformation p;
  */
 extern const transformation_graph<2, apollonian_transformation> graph;
 
+/* The same generators, as compile-time constants.  Each Mobius
+ * transformation is written as a matrix of Gaussian integers and its
+ * determinant; see static_mobius_transformation.
+ */
+using static_m0 = static_apollonian_transformation<
+    static_mobius_transformation<-1,  0,   0, -1,
+                                  0,  0,  -1,  0>,
+    static_permutation<3, 1, 2, 0>>;
+using static_m1 = static_apollonian_transformation<
+    static_mobius_transformation< 1,  0,   0,  0,
+                                  0, -1,   1,  0>,
+    static_permutation<0, 3, 2, 1>>;
+using static_m2 = static_apollonian_transformation<
+    static_mobius_transformation< 1, -1,   0,  1,
+                                  0, -1,   1,  1>,
+    static_permutation<0, 1, 3, 2>>;
+using static_n0 = static_apollonian_transformation<
+    static_mobius_transformation< 1, -1,   0,  0,
+                                  0, -2,   1,  1, 2>,
+    static_permutation<3, 2, 1, 0>>;
+using static_n1 = static_apollonian_transformation<
+    static_mobius_transformation<-1,  1,   0, -2,
+                                  0,  0,  -1, -1, 2>,
+    static_permutation<2, 3, 0, 1>>;
+using static_n2 = static_apollonian_transformation<
+    static_mobius_transformation< 1,  1,   0,  0,
+                                  0,  0,   1, -1, 2>,
+    static_permutation<1, 0, 3, 2>>;
+using static_p = static_apollonian_transformation<
+    static_mobius_transformation< 1,  1,  -2,  0,
+                                  2,  0,  -1,  1, 2>,
+    static_permutation<0, 1, 2, 3>>;
+
+/* The same graph as above, with the generators folded in at compile
+ * time.  This is the one used by generate_apollonian_gasket.
+ */
+using static_graph = static_transformation_graph<
+    /* Edges for node type A (triangle) */
+    static_edge_list<
+        static_graph_edge<0, edge_id(transformation_id::M0), static_m0>,
+        static_graph_edge<0, edge_id(transformation_id::M1), static_m1>,
+        static_graph_edge<0, edge_id(transformation_id::M2), static_m2>,
+        static_graph_edge<1, edge_id(transformation_id::P), static_p>>,
+    /* Edges for node type B (circle) */
+    static_edge_list<
+        static_graph_edge<1, edge_id(transformation_id::M0), static_m0>,
+        static_graph_edge<1, edge_id(transformation_id::M1), static_m1>,
+        static_graph_edge<1, edge_id(transformation_id::M2), static_m2>,
+        static_graph_edge<0, edge_id(transformation_id::N0), static_n0>,
+        static_graph_edge<0, edge_id(transformation_id::N1), static_n1>,
+        static_graph_edge<0, edge_id(transformation_id::N2), static_n2>,
+        static_graph_edge<0, edge_id(transformation_id::P), static_p>>>;
+
+/* The out-edges of one node type of graph, laid out for
+ * batched expansion (see batch.hpp).  Lanes past size_ repeat the first
+ * edge and are ignored.
+ */
+class edge_batch {
+public:
+    unsigned int size_;
+    node_type types_[batch_lanes];
+    transformation_id ids_[batch_lanes];
+    mobius_batch generators_;
+    permutation<4> permutations_[batch_lanes];
+};
+
+/* graph as edge batches, indexed by node type. */
+extern const std::array<edge_batch, 2> batch_graph;
+
 /* Circle through a0, a1, and a2. This is the main circle of the
  * canonical gasket.
  */
 extern const circle c;
 
-} // canonical
+/* Same as m(c), but much cheaper, since c is just the real line.  This
+ * is computed for every generated node.
+ */
+template <typename T>
+basic_circle<T> transform_c(const basic_mobius_transformation<T>& m);
 
-enum class node_type {
-    A = 0,  /* triangle-type */
-    B = 1,  /* circle-type */
-};
+} // canonical
 
-template <typename Data>
+/* The traversal copies one of these for every generated node, so it
+ * should stay small and trivially copyable.
+ *
+ * The node's circle is computed once when the node is generated and
+ * kept alongside its transformation.
+ *
+ * T is the precision of the geometry.  With T = float, the state is
+ * about half the size, but the error grows quickly with the depth; see
+ * the single-precision traversal below.
+ */
+template <typename Data, typename T = double>
 class apollonian_state {
-    using transform = apollonian_transformation;
-
 public:
+    using transformation = basic_apollonian_transformation<T>;
+
     apollonian_state() = default;
     apollonian_state(node_type type,
-                     const apollonian_transformation& m,
+                     const transformation& m,
+                     const Data& data);
+    apollonian_state(node_type type,
+                     const transformation& m,
+                     const basic_circle<T>& c,
                      const Data& data);
-    apollonian_state(const apollonian_state&) = default;
+
+    /* Conversion from another precision.  The circle is recomputed
+     * rather than converted.
+     */
+    template <typename U>
+    explicit apollonian_state(const apollonian_state<Data, U>& s);
 
     /* For a type-A node (triangle), the size is a rough approximation
      * to the diameter.  For a type-B node (circle), the size is the
@@ -108,37 +243,258 @@ public:
 
     /* For a type-A node (triangle), this is the circumcircle of the
      * three vertices.  For a type-B node (circle), this is the circle
-     * itself.
+     * itself.  It is always in double precision.
      */
     operator circle() const;
 
 public:
-    const node_type type_;
-    const apollonian_transformation t_;
-    const Data data_;
+    transformation t_;
+    basic_circle<T> c_;
+    node_type type_;
+    Data data_;
 };
 
-template <typename Data>
+template <typename T>
+inline basic_circle<T>
+canonical::transform_c(const basic_mobius_transformation<T>& m) {
+    /* The conjugation in mobius_transformation::operator () (const
+     * circle&), written out for the form with v00_ = v11_ = 0 and
+     * v01_ = -i.
+     */
+    using complex = std::complex<T>;
+
+    const complex& u00 =  m.v11_;
+    const complex  u01 = -m.v01_;
+    const complex  u10 = -m.v10_;
+    const complex& u11 =  m.v00_;
+
+    complex w = std::conj(u10)*u01 - std::conj(u00)*u11;
+
+    return {2*(std::conj(u00)*u10).imag(),
+            {-w.imag(), w.real()},
+            2*(std::conj(u01)*u11).imag()};
+}
+
+/* The circle in double precision. */
+inline const circle&
+promote(const circle& c) {
+    return c;
+}
+
+template <typename T>
+inline circle
+promote(const basic_circle<T>& c) {
+    return circle{c};
+}
+
+template <typename Data, typename T>
 inline
-apollonian_state<Data>::apollonian_state(node_type type,
-                                         const apollonian_transformation& t,
-                                         const Data& data)
-    : type_{type}, t_{t}, data_{data}
+apollonian_state<Data, T>::apollonian_state(node_type type,
+                                            const transformation& t,
+                                            const Data& data)
+    : apollonian_state{type, t, canonical::transform_c(t.g0_), data}
 {
 }
 
-template <typename Data>
+template <typename Data, typename T>
+inline
+apollonian_state<Data, T>::apollonian_state(node_type type,
+                                            const transformation& t,
+                                            const basic_circle<T>& c,
+                                            const Data& data)
+    : t_{t}, c_{c}, type_{type}, data_{data}
+{
+}
+
+template <typename Data, typename T>
+template <typename U>
+inline
+apollonian_state<Data, T>::apollonian_state(
+        const apollonian_state<Data, U>& s)
+    : apollonian_state{s.type_,
+                       {basic_mobius_transformation<T>{s.t_.g0_},
+                        s.t_.g1_},
+                       s.data_}
+{
+}
+
+/* The size of a node with the given circle, as in
+ * apollonian_state::size.
+ */
+template <typename T>
 inline double
-apollonian_state<Data>::size() const {
-    auto c = t_.g0_(canonical::c);
-    if (c.v00_ <= 0.0) return HUGE_VAL;
+node_size(const basic_circle<T>& c) {
+    if (c.v00_ <= 0) return HUGE_VAL;
     return std::abs(2*c.radius());
 }
 
-template <typename Data>
+template <typename Data, typename T>
+inline double
+apollonian_state<Data, T>::size() const {
+    return node_size(c_);
+}
+
+template <typename Data, typename T>
 inline
-apollonian_state<Data>::operator circle () const {
-    return t_.g0_(canonical::c);
+apollonian_state<Data, T>::operator circle () const {
+    return promote(c_);
+}
+
+/* Generate the children of state, pushing the ones accepted by the
+ * visitor onto the stack.
+ */
+template <typename Data, typename T, typename Visitor>
+inline void
+expand_apollonian_node(const apollonian_state<Data, T>& state,
+                       Visitor& visitor,
+                       std::vector<apollonian_state<Data, T>>& stack)
+{
+    unsigned int index = static_cast<unsigned int>(state.type_);
+    auto expand = [&](const auto& edge) {
+        node_type type = static_cast<node_type>(edge.type_index);
+        canonical::transformation_id id =
+            static_cast<canonical::transformation_id>(edge.id);
+        auto t = right_multiply(state.t_, edge);
+        basic_circle<T> c = canonical::transform_c(t.g0_);
+        Data data;
+        if (visitor.get_data(state, type, id, t, promote(c),
+                             intersection_type::invalid, data))
+        {
+            stack.emplace_back(type, t, c, data);
+        }
+    };
+    canonical::static_graph::for_each_edge(index, expand);
+}
+
+#ifdef APOLLONIAN_BATCH_EXPANSION
+template <typename Data, typename Visitor>
+inline void
+expand_apollonian_node(const apollonian_state<Data, double>& state,
+                       Visitor& visitor,
+                       std::vector<apollonian_state<Data, double>>& stack)
+{
+    unsigned int index = static_cast<unsigned int>(state.type_);
+    const canonical::edge_batch& edges = canonical::batch_graph[index];
+    mobius_batch m;
+    circle_batch c;
+    intersection_type intersection[batch_lanes];
+    compose_batch(state.t_.g0_, edges.generators_, m);
+    transform_c_batch(m, c);
+    intersects_batch(visitor.bounds(), c, intersection);
+    for (unsigned int k = 0; k < edges.size_; ++k) {
+        /* The permutations act on the opposite side. */
+        apollonian_transformation t{
+            m.get(k), edges.permutations_[k]*state.t_.g1_.g_};
+        circle ck = c.get(k);
+        Data data;
+        if (visitor.get_data(state, edges.types_[k], edges.ids_[k],
+                             t, ck, intersection[k], data))
+        {
+            stack.emplace_back(edges.types_[k], t, ck, data);
+        }
+    }
+}
+#endif
+
+/* Run the traversal starting from the states currently on the stack,
+ * until the stack is exhausted.  The seeds may be arbitrary nodes of
+ * the tree, e.g., the roots of independent subtrees.
+ *
+ * poll(stack) is called before each node is taken off the stack, and
+ * may remove any part of the stack except the top, e.g., to hand it to
+ * another thread.
+ *
+ * See generate_apollonian_gasket for the requirements on Visitor.
+ */
+template <typename Data, typename T, typename Visitor, typename Poll>
+void
+traverse_apollonian_gasket(std::vector<apollonian_state<Data, T>>& stack,
+                           Visitor& visitor, Poll&& poll)
+{
+    using State = apollonian_state<Data, T>;
+
+    while (stack.size()) {
+        poll(stack);
+        State state = std::move(stack.back());
+        stack.pop_back();
+        if (visitor.visit_node(state)) {
+            expand_apollonian_node(state, visitor, stack);
+        }
+    }
+}
+
+/* The traversal in single precision.  Single precision is only used
+ * near the top of the tree: every node smaller than
+ * visitor.promote_size() is converted to double precision, and its
+ * whole subtree is traversed in double precision before going on, so
+ * that the order of the nodes is the same as in a double-precision
+ * traversal.
+ *
+ * poll is called on the double-precision stack as well, so that the
+ * promoted subtrees, which are most of the work, can still be handed
+ * off.  It has to accept both kinds of stack.
+ *
+ * The circles of the single-precision nodes are accurate to about
+ * FLT_EPSILON*(d/r)^2 relative to the radius r, where d is the distance
+ * from the origin, so promote_size() should be large enough for that to
+ * be negligible.
+ */
+template <typename Data, typename Visitor, typename Poll>
+void
+traverse_apollonian_gasket(std::vector<apollonian_state<Data, float>>& stack,
+                           Visitor& visitor, Poll&& poll)
+{
+    using State = apollonian_state<Data, float>;
+
+    double promote_size = visitor.promote_size();
+    std::vector<apollonian_state<Data, double>> promoted;
+
+    while (stack.size()) {
+        poll(stack);
+        State state = std::move(stack.back());
+        stack.pop_back();
+        if (state.size() < promote_size) {
+            promoted.emplace_back(state);
+            traverse_apollonian_gasket(promoted, visitor, poll);
+        } else if (visitor.visit_node(state)) {
+            expand_apollonian_node(state, visitor, stack);
+        }
+    }
+}
+
+template <typename Data, typename T, typename Visitor>
+void
+traverse_apollonian_gasket(std::vector<apollonian_state<Data, T>>& stack,
+                           Visitor& visitor)
+{
+    traverse_apollonian_gasket(stack, visitor, [](auto&) {});
+}
+
+/* The two seed states of the gasket, namely the interior and exterior
+ * of the main circle.  The arguments are as for
+ * generate_apollonian_gasket.
+ */
+template <typename Data, typename T>
+void
+push_apollonian_seeds(
+        const pcomplex& z0, const pcomplex& z1, const pcomplex& z2,
+        const Data& data0, const Data& data1,
+        std::vector<apollonian_state<Data, T>>& stack)
+{
+    using transform = basic_apollonian_transformation<T>;
+    using mobius = basic_mobius_transformation<T>;
+    using canonical::a0;
+    using canonical::a1;
+    using canonical::a2;
+
+    /* The seeds are always computed in double precision. */
+    transform t0{mobius{mobius_transformation{a0, a1, a2, z0, z1, z2}},
+                 {0, 1, 2, 3}};
+    transform t1{mobius{mobius_transformation{a0, a1, a2, z0, z2, z1}},
+                 {0, 2, 1, 3}};
+
+    stack.emplace_back(node_type::B, t0, data0);
+    stack.emplace_back(node_type::B, t1, data1);
 }
 
 /* Main entry point to this module.
@@ -153,11 +509,20 @@ apollonian_state<Data>::operator circle () const {
  *
  * The Visitor type should have the methods
  *
- *     bool Visitor::visit_node(const apollonian_state<Data>& state);
- *     Data Visitor::get_data(const apollonian_state<Data>& parent,
+ *     bool Visitor::visit_node(const apollonian_state<Data, T>& state);
+ *     bool Visitor::get_data(const apollonian_state<Data, T>& parent,
  *                            node_type type,
  *                            transformation_id id,
- *                            const apollonian_transformation t) const;
+ *                            const basic_apollonian_transformation<T>& t,
+ *                            const circle& c,
+ *                            intersection_type bounds_intersection,
+ *                            Data& data) const;
+ *     const box& Visitor::bounds() const;
+ *
+ * for T = double, and also for T = float when traversing in single
+ * precision, in which case it also needs
+ *
+ *     double Visitor::promote_size() const;
  *
  * The return value of visit_node indicates whether we are interested
  * in further iterations of this node.  visit_node will be called once
@@ -165,8 +530,16 @@ apollonian_state<Data>::operator circle () const {
  * is unspecified, but a given node will always be visited before its
  * children.
  *
- * get_data should return the child node's data given the parent node
- * and child node's type and transformation.
+ * get_data should set the child node's data given the parent node
+ * and child node's type, transformation, and circle (as in
+ * apollonian_state::operator circle).  It may instead return false to
+ * discard the child, in which case the child is never visited and data
+ * need not be set.  This is much cheaper than rejecting the child in
+ * visit_node, since most generated nodes are leaves.
+ *
+ * bounds_intersection is bounds().intersects_circle(c) if the traversal
+ * computed it as part of a batched expansion (see batch.hpp), and
+ * intersection_type::invalid otherwise.
  */
 template <typename Data, typename Visitor>
 void
@@ -175,41 +548,13 @@ generate_apollonian_gasket(
         const Data& data0, const Data& data1,
         Visitor& visitor)
 {
-    using State = apollonian_state<Data>;
-    using transform = apollonian_transformation;
-    using canonical::a0;
-    using canonical::a1;
-    using canonical::a2;
-
     /* This could equally well be done with true recursion, but we
      * use an explicit stack as a more lightweight alternative.
      */
-    std::vector<State> stack;
-
-    transform t0{{a0, a1, a2, z0, z1, z2}, {0, 1, 2, 3}};
-    transform t1{{a0, a1, a2, z0, z2, z1}, {0, 2, 1, 3}};
-
-    /* The two seeds, namely the interior and exterior of the main
-     * circle.
-     */
-    stack.emplace_back(node_type::B, t0, data0);
-    stack.emplace_back(node_type::B, t1, data1);
+    std::vector<apollonian_state<Data>> stack;
 
-    while (stack.size()) {
-        State state = stack.back();
-        stack.pop_back();
-        if (visitor.visit_node(state)) {
-            unsigned int index = static_cast<unsigned int>(state.type_);
-            for (const auto& edge : canonical::graph.edges_[index]) {
-                node_type type = static_cast<node_type>(edge.type_index);
-                canonical::transformation_id id =
-                    static_cast<canonical::transformation_id>(edge.id);
-                auto t = state.t_*edge.transform;
-                stack.emplace_back(type, t,
-                                   visitor.get_data(state, type, id, t));
-            }
-        }
-    }
+    push_apollonian_seeds(z0, z1, z2, data0, data1, stack);
+    traverse_apollonian_gasket(stack, visitor);
 }
 
 } // apollonian
@@ -0,0 +1,215 @@
+/* SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Copyright 2024 Darsh Ranjan.
+ *
+ * This file is part of super-apollonian-cpp.
+ */
+
+/* Batched expansion of a node into all of its children at once.
+ *
+ * All children of a node are computed from the same parent
+ * transformation, and the arithmetic for each child is the same except
+ * for the generator it is composed with.  Here the children are kept in
+ * structure-of-arrays layout, with one lane per child, and every
+ * function is a loop over all lanes with no branches, so that the
+ * compiler vectorizes across children.  With AVX-512, one register
+ * holds a value for all seven children of a type-B node, and with AVX2
+ * it takes two.
+ *
+ * This only pays off with wide vectors, so traverse_apollonian_gasket
+ * only uses it when those are enabled at compile time (see
+ * APOLLONIAN_BATCH_EXPANSION and the "native" build option).  Otherwise
+ * the scalar expansion over canonical::static_graph is used.  Note that
+ * GCC will only vectorize intersects_batch with -fno-trapping-math,
+ * because of the comparisons.
+ */
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <algorithm>
+#include <cmath>
+
+#include "riemann_sphere.hpp"
+#include "mobius.hpp"
+#include "circle.hpp"
+#include "box.hpp"
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#define APOLLONIAN_BATCH_EXPANSION 1
+#endif
+
+namespace apollonian {
+
+/* Enough for the seven children of a type-B node.  Unused lanes are
+ * computed anyway and ignored.
+ */
+constexpr unsigned int batch_lanes = 8;
+
+class mobius_batch {
+public:
+    void set(unsigned int lane, const mobius_transformation& m);
+    mobius_transformation get(unsigned int lane) const;
+
+public:
+    alignas(64) double v00r_[batch_lanes];
+    alignas(64) double v00i_[batch_lanes];
+    alignas(64) double v01r_[batch_lanes];
+    alignas(64) double v01i_[batch_lanes];
+    alignas(64) double v10r_[batch_lanes];
+    alignas(64) double v10i_[batch_lanes];
+    alignas(64) double v11r_[batch_lanes];
+    alignas(64) double v11i_[batch_lanes];
+};
+
+class circle_batch {
+public:
+    circle get(unsigned int lane) const;
+
+public:
+    alignas(64) double v00_[batch_lanes];
+    alignas(64) double v01r_[batch_lanes];
+    alignas(64) double v01i_[batch_lanes];
+    alignas(64) double v11_[batch_lanes];
+};
+
+/* children[k] = parent*generators[k] */
+void compose_batch(const mobius_transformation& parent,
+                   const mobius_batch& generators,
+                   mobius_batch& children);
+
+/* circles[k] = canonical::transform_c(m[k]) */
+void transform_c_batch(const mobius_batch& m, circle_batch& circles);
+
+/* result[k] = bounds.intersects_circle(circles[k]) */
+void intersects_batch(const box& bounds, const circle_batch& circles,
+                      intersection_type* result);
+
+inline void
+mobius_batch::set(unsigned int lane, const mobius_transformation& m) {
+    v00r_[lane] = m.v00_.real();
+    v00i_[lane] = m.v00_.imag();
+    v01r_[lane] = m.v01_.real();
+    v01i_[lane] = m.v01_.imag();
+    v10r_[lane] = m.v10_.real();
+    v10i_[lane] = m.v10_.imag();
+    v11r_[lane] = m.v11_.real();
+    v11i_[lane] = m.v11_.imag();
+}
+
+inline mobius_transformation
+mobius_batch::get(unsigned int lane) const {
+    return {{v00r_[lane], v00i_[lane]}, {v01r_[lane], v01i_[lane]},
+            {v10r_[lane], v10i_[lane]}, {v11r_[lane], v11i_[lane]}};
+}
+
+inline circle
+circle_batch::get(unsigned int lane) const {
+    return {v00_[lane], {v01r_[lane], v01i_[lane]}, v11_[lane]};
+}
+
+inline void
+compose_batch(const mobius_transformation& parent,
+              const mobius_batch& g, mobius_batch& m)
+{
+    const double p00r = parent.v00_.real();
+    const double p00i = parent.v00_.imag();
+    const double p01r = parent.v01_.real();
+    const double p01i = parent.v01_.imag();
+    const double p10r = parent.v10_.real();
+    const double p10i = parent.v10_.imag();
+    const double p11r = parent.v11_.real();
+    const double p11i = parent.v11_.imag();
+
+    for (unsigned int k = 0; k < batch_lanes; ++k) {
+        m.v00r_[k] = p00r*g.v00r_[k] - p00i*g.v00i_[k]
+                   + p01r*g.v10r_[k] - p01i*g.v10i_[k];
+        m.v00i_[k] = p00r*g.v00i_[k] + p00i*g.v00r_[k]
+                   + p01r*g.v10i_[k] + p01i*g.v10r_[k];
+        m.v01r_[k] = p00r*g.v01r_[k] - p00i*g.v01i_[k]
+                   + p01r*g.v11r_[k] - p01i*g.v11i_[k];
+        m.v01i_[k] = p00r*g.v01i_[k] + p00i*g.v01r_[k]
+                   + p01r*g.v11i_[k] + p01i*g.v11r_[k];
+        m.v10r_[k] = p10r*g.v00r_[k] - p10i*g.v00i_[k]
+                   + p11r*g.v10r_[k] - p11i*g.v10i_[k];
+        m.v10i_[k] = p10r*g.v00i_[k] + p10i*g.v00r_[k]
+                   + p11r*g.v10i_[k] + p11i*g.v10r_[k];
+        m.v11r_[k] = p10r*g.v01r_[k] - p10i*g.v01i_[k]
+                   + p11r*g.v11r_[k] - p11i*g.v11i_[k];
+        m.v11i_[k] = p10r*g.v01i_[k] + p10i*g.v01r_[k]
+                   + p11r*g.v11i_[k] + p11i*g.v11r_[k];
+    }
+}
+
+inline void
+transform_c_batch(const mobius_batch& m, circle_batch& c) {
+    /* See canonical::transform_c. */
+    for (unsigned int k = 0; k < batch_lanes; ++k) {
+        /* w = conj(v10)*v01 - conj(v11)*v00 */
+        double wr = m.v10r_[k]*m.v01r_[k] + m.v10i_[k]*m.v01i_[k]
+                  - m.v11r_[k]*m.v00r_[k] - m.v11i_[k]*m.v00i_[k];
+        double wi = m.v10r_[k]*m.v01i_[k] - m.v10i_[k]*m.v01r_[k]
+                  - m.v11r_[k]*m.v00i_[k] + m.v11i_[k]*m.v00r_[k];
+
+        c.v00_[k] = 2*(m.v11i_[k]*m.v10r_[k] - m.v11r_[k]*m.v10i_[k]);
+        c.v01r_[k] = -wi;
+        c.v01i_[k] = wr;
+        c.v11_[k] = 2*(m.v01i_[k]*m.v00r_[k] - m.v01r_[k]*m.v00i_[k]);
+    }
+}
+
+inline void
+intersects_batch(const box& b, const circle_batch& c,
+                 intersection_type* result)
+{
+    /* Both cases of box::intersects_circle are computed in every lane,
+     * and the right one is selected at the end.  The codes are built
+     * arithmetically, using outside == intersects - 1.
+     */
+    alignas(64) int code[batch_lanes];
+
+    for (unsigned int k = 0; k < batch_lanes; ++k) {
+        double v00 = c.v00_[k];
+        double a = c.v01r_[k];
+        double bb = c.v01i_[k];
+        double v11 = c.v11_[k];
+
+        /* Half space or disk complement: outside if all corners are. */
+        double f00 = v00*(b.xmin*b.xmin + b.ymin*b.ymin)
+                   + 2*(a*b.xmin + bb*b.ymin) + v11;
+        double f01 = v00*(b.xmin*b.xmin + b.ymax*b.ymax)
+                   + 2*(a*b.xmin + bb*b.ymax) + v11;
+        double f10 = v00*(b.xmax*b.xmax + b.ymin*b.ymin)
+                   + 2*(a*b.xmax + bb*b.ymin) + v11;
+        double f11 = v00*(b.xmax*b.xmax + b.ymax*b.ymax)
+                   + 2*(a*b.xmax + bb*b.ymax) + v11;
+        int all_outside = (f00 >= 0) & (f01 >= 0) &
+                          (f10 >= 0) & (f11 >= 0);
+        int complement_code = int(intersection_type::intersects)
+                            - all_outside;
+
+        /* Disk, compared in squared distances to avoid std::sqrt */
+        double x = -a/v00;
+        double y = -bb/v00;
+        double r2 = (a*a + bb*bb - v00*v11)/(v00*v00);
+        double ex = std::min(x - b.xmin, b.xmax - x);
+        double ey = std::min(y - b.ymin, b.ymax - y);
+        double e = std::min(ex, ey);
+        int inside = (e >= 0) & (r2 <= e*e);
+        double dx = x - std::min(std::max(x, b.xmin), b.xmax);
+        double dy = y - std::min(std::max(y, b.ymin), b.ymax);
+        int outside = dx*dx + dy*dy > r2;
+        int disk_code = inside*int(intersection_type::inside)
+                      + (1 - inside)*(int(intersection_type::intersects)
+                                      - outside);
+
+        code[k] = v00 <= 0 ? complement_code : disk_code;
+    }
+
+    for (unsigned int k = 0; k < batch_lanes; ++k) {
+        result[k] = static_cast<intersection_type>(code[k]);
+    }
+}
+
+} // apollonian
+
+#endif // BATCH_HPP
@@ -13,7 +13,7 @@
 
 namespace apollonian {
 
-enum class intersection_type {
+enum class intersection_type : unsigned char {
     invalid = 0,
     inside = 1,
     outside = 2,
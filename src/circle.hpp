@@ -33,98 +33,126 @@ namespace apollonian {
  *
  * The "disk" interpretation in particular is pretty useful for us, so
  * we choose signs consistently.
+ *
+ * T is the real scalar type, as in basic_mobius_transformation.
  */
-class circle {
+template <typename T>
+class basic_circle {
 public:
-    circle() = default;
-    circle(double v00, const dcomplex& v01, double v11);
-    circle(const dcomplex& center, double radius);
-    circle(const pcomplex& z0, const pcomplex& z1, const pcomplex& z2);
+    using complex = std::complex<T>;
+    using pcomplex = basic_pcomplex<T>;
+
+    basic_circle() = default;
+    basic_circle(T v00, const complex& v01, T v11);
+    basic_circle(const complex& center, T radius);
+    basic_circle(const pcomplex& z0, const pcomplex& z1, const pcomplex& z2);
+
+    /* Conversion from another precision. */
+    template <typename U>
+    explicit basic_circle(const basic_circle<U>& c);
 
-    dcomplex center() const;
-    double radius() const;
+    complex center() const;
+    T radius() const;
 
-    circle reverse() const;
+    basic_circle reverse() const;
 
-    double operator () (const pcomplex& z) const;
+    T operator () (const pcomplex& z) const;
 
 public:
     /* The full matrix of the quadratic form is
      *         v00_   v01_
      *    conj(v01_)  v11_.
      */
-    double  v00_;
-    dcomplex v01_;
-    double  v11_;
+    T       v00_;
+    complex v01_;
+    T       v11_;
 };
 
-template <>
-inline circle
-mobius_transformation::operator () (const circle& t) const {
-    const dcomplex& v00 =  v11_;
-    const dcomplex& v01 = -v01_;
-    const dcomplex& v10 = -v10_;
-    const dcomplex& v11 =  v00_;
-
-    dcomplex v00h = std::conj(v00);
-    dcomplex v01h = std::conj(v10);
-    dcomplex v10h = std::conj(v01);
-    dcomplex v11h = std::conj(v11);
-
-    const dcomplex& c00 = t.v00_;
-    const dcomplex& c01 = t.v01_;
-    dcomplex        c10 = std::conj(t.v01_);
-    const dcomplex& c11 = t.v11_;
-
-    dcomplex w00 = c00*v00 + c01*v10;
-    dcomplex w01 = c00*v01 + c01*v11;
-    dcomplex w10 = c10*v00 + c11*v10;
-    dcomplex w11 = c10*v01 + c11*v11;
+using circle = basic_circle<double>;
+
+template <typename T>
+inline basic_circle<T>
+basic_mobius_transformation<T>::operator () (const basic_circle<T>& t) const
+{
+    const complex& v00 =  v11_;
+    const complex& v01 = -v01_;
+    const complex& v10 = -v10_;
+    const complex& v11 =  v00_;
+
+    complex v00h = std::conj(v00);
+    complex v01h = std::conj(v10);
+    complex v10h = std::conj(v01);
+    complex v11h = std::conj(v11);
+
+    const complex& c00 = t.v00_;
+    const complex& c01 = t.v01_;
+    complex        c10 = std::conj(t.v01_);
+    const complex& c11 = t.v11_;
+
+    complex w00 = c00*v00 + c01*v10;
+    complex w01 = c00*v01 + c01*v11;
+    complex w10 = c10*v00 + c11*v10;
+    complex w11 = c10*v01 + c11*v11;
 
     return {(v00h*w00 + v01h*w10).real(),
              v00h*w01 + v01h*w11,
             (v10h*w01 + v11h*w11).real()};
 }
 
+template <typename T>
 inline
-circle::circle(double v00, const dcomplex& v01, double v11)
+basic_circle<T>::basic_circle(T v00, const complex& v01, T v11)
     : v00_{v00}, v01_{v01}, v11_{v11}
 {
 }
 
+template <typename T>
 inline
-circle::circle(const dcomplex& center, double radius)
+basic_circle<T>::basic_circle(const complex& center, T radius)
     : v00_{1/radius}, v01_{-center/radius},
       v11_{std::norm(center)/radius - radius}
 {
 }
 
+template <typename T>
 inline
-circle::circle(
+basic_circle<T>::basic_circle(
         const pcomplex& z0, const pcomplex& z1, const pcomplex& z2)
 {
-    mobius_transformation m
-        = mobius_transformation::cross_ratio(z0, z1, z2).inverse();
-    *this = m(circle{0, -1.0, 0});
+    basic_mobius_transformation<T> m
+        = basic_mobius_transformation<T>::cross_ratio(z0, z1, z2).inverse();
+    *this = m(basic_circle{0, T(-1), 0});
+}
+
+template <typename T>
+template <typename U>
+inline
+basic_circle<T>::basic_circle(const basic_circle<U>& c)
+    : v00_{T(c.v00_)}, v01_{complex(c.v01_)}, v11_{T(c.v11_)}
+{
 }
 
-inline dcomplex
-circle::center() const {
+template <typename T>
+inline std::complex<T>
+basic_circle<T>::center() const {
     return -v01_/v00_;
 }
 
-inline double
-circle::radius() const {
+template <typename T>
+inline T
+basic_circle<T>::radius() const {
     return std::sqrt(std::norm(v01_) - v00_*v11_)/v00_;
 }
 
-inline circle
-circle::reverse() const {
+template <typename T>
+inline basic_circle<T>
+basic_circle<T>::reverse() const {
     return {-v00_, -v01_, -v11_};
 }
 
-inline double
-circle::operator () (const pcomplex& z) const {
+template <typename T>
+inline T
+basic_circle<T>::operator () (const pcomplex& z) const {
     return v00_*std::norm(z.v0_) +
            2*(v01_*std::conj(z.v0_)*z.v1_).real() +
            v11_*std::norm(z.v1_);
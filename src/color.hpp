@@ -10,9 +10,23 @@
 
 #include <stdint.h>
 
+#include <cstddef>
+
 namespace apollonian {
 
-class rgb_color {
+/* With APOLLONIAN_PADDED_PIXELS (the "pixels" build option), each
+ * color is padded to 16 bytes with an unused fourth channel, which is
+ * kept at 0.  The additive operations then cover all four channels, so
+ * that each is a single 128-bit vector operation, and pixels never
+ * straddle a vector boundary.
+ */
+#ifdef APOLLONIAN_PADDED_PIXELS
+constexpr std::size_t rgb_color_alignment = 16;
+#else
+constexpr std::size_t rgb_color_alignment = alignof(int32_t);
+#endif
+
+class alignas(rgb_color_alignment) rgb_color {
 public:
     rgb_color() = default;
     rgb_color(double r, double g, double b);
@@ -38,12 +52,25 @@ public:
     int32_t r_;
     int32_t g_;
     int32_t b_;
+#ifdef APOLLONIAN_PADDED_PIXELS
+    int32_t pad_;
+#endif
 };
 
+/* A channel of a color as the 8-bit value written to image files */
+inline uint8_t
+get_component(int32_t value) {
+    if (value < 0) return 0;
+    return value >> 23;
+}
+
 inline rgb_color::rgb_color(double r, double g, double b)
     : r_{int32_t(r*0x7fffffff)},
       g_{int32_t(g*0x7fffffff)},
       b_{int32_t(b*0x7fffffff)}
+#ifdef APOLLONIAN_PADDED_PIXELS
+    , pad_{0}
+#endif
 {
 }
 
@@ -80,6 +107,9 @@ rgb_color::operator += (const rgb_color& other) {
     r_ += other.r_;
     g_ += other.g_;
     b_ += other.b_;
+#ifdef APOLLONIAN_PADDED_PIXELS
+    pad_ += other.pad_;
+#endif
 
     return *this;
 }
@@ -89,6 +119,9 @@ rgb_color::operator -= (const rgb_color& other) {
     r_ -= other.r_;
     g_ -= other.g_;
     b_ -= other.b_;
+#ifdef APOLLONIAN_PADDED_PIXELS
+    pad_ -= other.pad_;
+#endif
 
     return *this;
 }
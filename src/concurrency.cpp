@@ -27,20 +27,37 @@ grid_dispatch::grid_dispatch(
 grid_dispatch::~grid_dispatch() {
 }
 
+int grid_dispatch::cell_cols() const {
+    return cell_cols_;
+}
+
+int grid_dispatch::cell_rows() const {
+    return cell_rows_;
+}
+
+void grid_dispatch::prepare() {
+}
+
+void grid_dispatch::run_idle(int, std::mutex&) {
+}
+
 void grid_dispatch::run() {
+    prepare();
+
     std::vector<std::thread> workers;
     for (int k = 0; k < num_threads_; ++k) {
-        workers.emplace_back(&grid_dispatch::do_work, this);
+        workers.emplace_back(&grid_dispatch::do_work, this, k);
     }
     for (auto& worker : workers) worker.join();
 }
 
-void grid_dispatch::do_work() {
+void grid_dispatch::do_work(int worker) {
     int col0;
     int row0;
     while (next_cell(col0, row0)) {
-        run_cell(col0, row0, cell_cols_, cell_rows_, run_mutex_);
+        run_cell(worker, col0, row0, cell_cols_, cell_rows_, run_mutex_);
     }
+    run_idle(worker, run_mutex_);
 }
 
 bool grid_dispatch::next_cell(int& col0, int& row0) {
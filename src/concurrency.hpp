@@ -8,10 +8,79 @@
 #ifndef CONCURRENCY_HPP
 #define CONCURRENCY_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <iterator>
 #include <mutex>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 namespace apollonian {
 
+/* A point through which idle threads can take over part of the
+ * explicit work stack of a busy thread.
+ *
+ * The owner keeps its stack to itself and calls poll() before taking
+ * each item.  That costs a single relaxed atomic load unless a thief is
+ * waiting, in which case the bottom half of the stack (the oldest items,
+ * which are normally the largest subtrees) is handed over.
+ *
+ * The owner may work through stacks of any of the types Ts, e.g., when
+ * a traversal switches precision partway down, and the thief gets the
+ * items with their type unchanged.
+ *
+ * Each opening of the point carries a tag, which is handed to the thief
+ * along with the stolen items.  It can also carry a counter, which is
+ * incremented whenever items are handed over, before the owner can
+ * close the point.  As long as thieves decrement it once they are done
+ * with their loot, the counter then never misses work in flight.
+ */
+template <typename... Ts>
+class steal_point {
+public:
+    steal_point();
+
+    /* Owner interface.  poll takes a stack of any of the types Ts. */
+    void open(int tag, std::atomic<int>* loot_count = nullptr);
+    template <typename T>
+    void poll(std::vector<T>& stack);
+    void close();
+
+    /* Thief interface.  The items are moved into the loot stack of
+     * their type, and the other loot stacks are cleared.  steal returns
+     * false if nothing was taken.
+     */
+    bool steal(int& tag, std::vector<Ts>&... loot);
+    bool is_open();
+
+private:
+    template <typename T>
+    void serve(std::vector<T>& stack);
+
+private:
+    std::atomic<bool> requested_;
+    std::mutex mutex_;
+    std::mutex thief_mutex_;
+    std::condition_variable served_cv_;
+    bool open_;
+    bool served_;
+    int tag_;
+    int loot_tag_;
+    std::atomic<int>* loot_count_;
+    std::size_t loot_size_;
+    std::tuple<std::vector<Ts>...> loot_;
+};
+
+/* Call f(begin, end) for consecutive blocks [begin, end) covering
+ * [0, n), of block items each except maybe the last, from num_threads
+ * threads including the calling one.  Blocks are handed out in order,
+ * as threads become free.
+ */
+template <typename F>
+void parallel_blocks(int num_threads, int n, int block, F f);
+
 class grid_dispatch {
 public:
     void run();
@@ -23,12 +92,24 @@ protected:
         int cell_cols, int cell_rows);
     virtual ~grid_dispatch();
 
-    virtual void run_cell(int col0, int row0, int cols, int rows,
+    /* The size of the cells, except at the right and bottom edges. */
+    int cell_cols() const;
+    int cell_rows() const;
+
+    /* Called once by run() before any cell is dispatched. */
+    virtual void prepare();
+
+    /* worker is the index of the calling thread, in [0, num_threads). */
+    virtual void run_cell(int worker,
+                          int col0, int row0, int cols, int rows,
                           std::mutex& run_mutex) = 0;
 
+    /* Called by each thread once no cells are left to dispatch. */
+    virtual void run_idle(int worker, std::mutex& run_mutex);
+
 private:
     bool next_cell(int& col0, int& row0);
-    void do_work();
+    void do_work(int worker);
 
 private:
     int num_threads_;
@@ -44,6 +125,104 @@ private:
     std::mutex run_mutex_;
 };
 
+template <typename... Ts>
+steal_point<Ts...>::steal_point()
+    : requested_{false}, open_{false}, served_{false}, tag_{0}, loot_tag_{0},
+      loot_count_{nullptr}, loot_size_{0}
+{
+}
+
+template <typename... Ts>
+void steal_point<Ts...>::open(int tag, std::atomic<int>* loot_count) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    open_ = true;
+    tag_ = tag;
+    loot_count_ = loot_count;
+}
+
+template <typename... Ts>
+template <typename T>
+inline void steal_point<Ts...>::poll(std::vector<T>& stack) {
+    if (requested_.load(std::memory_order_relaxed)) serve(stack);
+}
+
+template <typename... Ts>
+template <typename T>
+void steal_point<Ts...>::serve(std::vector<T>& stack) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (served_) return;
+
+    std::vector<T>& loot = std::get<std::vector<T>>(loot_);
+    auto middle = stack.begin() + stack.size()/2;
+    loot.assign(std::make_move_iterator(stack.begin()),
+                std::make_move_iterator(middle));
+    stack.erase(stack.begin(), middle);
+    loot_tag_ = tag_;
+    loot_size_ = loot.size();
+    if (loot_count_ && loot_size_ > 0) ++*loot_count_;
+
+    served_ = true;
+    requested_.store(false, std::memory_order_relaxed);
+    served_cv_.notify_all();
+}
+
+template <typename... Ts>
+void steal_point<Ts...>::close() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    open_ = false;
+    requested_.store(false, std::memory_order_relaxed);
+    served_cv_.notify_all();
+}
+
+template <typename... Ts>
+bool steal_point<Ts...>::steal(int& tag, std::vector<Ts>&... loot) {
+    std::unique_lock<std::mutex> thief_lock(thief_mutex_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_) return false;
+
+    served_ = false;
+    requested_.store(true, std::memory_order_relaxed);
+    served_cv_.wait(lock, [this] { return served_ || !open_; });
+    requested_.store(false, std::memory_order_relaxed);
+
+    if (!served_ || loot_size_ == 0) return false;
+
+    /* Only one of the loot stacks is filled at a time. */
+    auto take = [](auto& dst, auto& src) {
+        dst.assign(std::make_move_iterator(src.begin()),
+                   std::make_move_iterator(src.end()));
+        src.clear();
+    };
+    int expand[] = {(take(loot, std::get<std::vector<Ts>>(loot_)), 0)...};
+    (void)expand;
+    loot_size_ = 0;
+    tag = loot_tag_;
+    return true;
+}
+
+template <typename... Ts>
+bool steal_point<Ts...>::is_open() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return open_;
+}
+
+template <typename F>
+void parallel_blocks(int num_threads, int n, int block, F f) {
+    std::atomic<int> next{0};
+    auto work = [&next, n, block, &f] {
+        for (;;) {
+            int begin = next.fetch_add(block);
+            if (begin >= n) return;
+            f(begin, std::min(n, begin + block));
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int k = 1; k < num_threads; ++k) workers.emplace_back(work);
+    work();
+    for (auto& worker : workers) worker.join();
+}
+
 } // apollonian
 
 #endif // CONCURRENCY_HPP
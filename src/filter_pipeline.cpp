@@ -0,0 +1,161 @@
+/* SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Copyright 2024 Darsh Ranjan.
+ *
+ * This file is part of super-apollonian-cpp.
+ */
+
+#include "filter_pipeline.hpp"
+
+#include <algorithm>
+
+#include "concurrency.hpp"
+
+namespace apollonian {
+
+namespace {
+
+/* Output tiles are at least min_tile_size, and tile_padding_ratio
+ * times the padding.  See stages_tile_size.
+ */
+constexpr int min_tile_size = 256;
+constexpr int tile_padding_ratio = 8;
+
+int stages_padding(const std::vector<const filter_stage*>& stages) {
+    /* The padding before each stage is its halo plus the padding after
+     * it, scaled up by its factor.
+     */
+    int padding = 0;
+    for (auto it = stages.rbegin(); it != stages.rend(); ++it) {
+        padding = (*it)->halo() + padding*(*it)->factor();
+    }
+    return padding;
+}
+
+int stages_factor(const std::vector<const filter_stage*>& stages) {
+    int factor = 1;
+    for (const filter_stage* stage : stages) factor *= stage->factor();
+    return factor;
+}
+
+/* The input range [begin, end) that output range [begin, end) of the
+ * stages depends on, along one axis.
+ */
+void input_range(const std::vector<const filter_stage*>& stages,
+                 int& begin, int& end)
+{
+    for (auto it = stages.rbegin(); it != stages.rend(); ++it) {
+        begin = begin*(*it)->factor();
+        end = end*(*it)->factor() + 2*(*it)->halo();
+    }
+}
+
+void filter_rect(const std::vector<const filter_stage*>& stages,
+                 image_view<const rgb_color> data,
+                 image_view<rgb_color> result,
+                 int row0, int row1, int col0, int col1)
+{
+    int src_row0 = row0;
+    int src_row1 = row1;
+    int src_col0 = col0;
+    int src_col1 = col1;
+    input_range(stages, src_row0, src_row1);
+    input_range(stages, src_col0, src_col1);
+
+    planar_image<double> tile = split_channels(
+        data.window(src_col0, src_row0,
+                    src_col1 - src_col0, src_row1 - src_row0));
+    for (const filter_stage* stage : stages) {
+        tile = stage->apply_tile(tile);
+    }
+    merge_channels(tile, result.window(col0, row0,
+                                       col1 - col0, row1 - row0));
+}
+
+} // namespace
+
+int stages_tile_size(const std::vector<const filter_stage*>& stages) {
+    return std::max(min_tile_size,
+                    tile_padding_ratio*stages_padding(stages));
+}
+
+image_buffer<rgb_color>
+apply_stages(const std::vector<const filter_stage*>& stages,
+             const image_buffer<rgb_color>& data, int num_threads)
+{
+    int padding = stages_padding(stages);
+    int factor = stages_factor(stages);
+    int rows = (data.rows() - 2*padding)/factor;
+    int cols = (data.cols() - 2*padding)/factor;
+    image_buffer<rgb_color> result(rows, cols);
+
+    int tile_size = stages_tile_size(stages);
+    int tile_rows = (rows + tile_size - 1)/tile_size;
+    int tile_cols = (cols + tile_size - 1)/tile_size;
+    parallel_blocks(num_threads, tile_rows*tile_cols, 1,
+                    [&](int begin, int end) {
+        for (int t = begin; t < end; ++t) {
+            int row0 = (t/tile_cols)*tile_size;
+            int col0 = (t % tile_cols)*tile_size;
+            filter_rect(stages, data, result,
+                        row0, std::min(rows, row0 + tile_size),
+                        col0, std::min(cols, col0 + tile_size));
+        }
+    });
+    return result;
+}
+
+void filter_pipeline::add(std::unique_ptr<filter_stage> stage) {
+    stages_.push_back(std::move(stage));
+}
+
+int filter_pipeline::padding() const {
+    return stages_padding(stages());
+}
+
+int filter_pipeline::factor() const {
+    return stages_factor(stages());
+}
+
+int filter_pipeline::input_size(int output_size) const {
+    return output_size*factor() + 2*padding();
+}
+
+int filter_pipeline::output_size(int input_size) const {
+    return (input_size - 2*padding())/factor();
+}
+
+int filter_pipeline::tile_size() const {
+    return stages_tile_size(stages());
+}
+
+void filter_pipeline::input_rect(int& row0, int& row1,
+                                 int& col0, int& col1) const
+{
+    input_range(stages(), row0, row1);
+    input_range(stages(), col0, col1);
+}
+
+void filter_pipeline::apply_rect(image_view<const rgb_color> data,
+                                 image_view<rgb_color> result,
+                                 int row0, int row1, int col0, int col1) const
+{
+    filter_rect(stages(), data, result, row0, row1, col0, col1);
+}
+
+void filter_pipeline::set_threads(int num_threads) {
+    num_threads_ = std::max(num_threads, 1);
+}
+
+image_buffer<rgb_color>
+filter_pipeline::apply(const image_buffer<rgb_color>& data) const {
+    return apply_stages(stages(), data, num_threads_);
+}
+
+std::vector<const filter_stage*> filter_pipeline::stages() const {
+    std::vector<const filter_stage*> result;
+    for (const auto& stage : stages_) result.push_back(stage.get());
+    return result;
+}
+
+} // apollonian
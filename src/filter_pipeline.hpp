@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Copyright 2024 Darsh Ranjan.
+ *
+ * This file is part of super-apollonian-cpp.
+ */
+
+/* Chains of post-processing filters.
+ *
+ * Each stage of a pipeline declares the halo it needs around its
+ * output, and the factor by which it shrinks the image.  From these,
+ * the pipeline works out how much padding the rendered image needs, and
+ * which part of the rendered image each part of the output depends on.
+ * It then runs all the stages on one tile of the output at a time, so
+ * that the intermediate images are tile-sized and stay in cache, and
+ * no stage costs an extra pass over the full image.  The tiles are
+ * spread over the filter threads.
+ *
+ * The rendered image is converted to planar doubles once per tile, all
+ * the stages work in that format, and the last result is converted
+ * back to rgb_color.
+ */
+#ifndef FILTER_PIPELINE_HPP
+#define FILTER_PIPELINE_HPP
+
+#include <memory>
+#include <vector>
+
+#include "color.hpp"
+#include "image_buffer.hpp"
+#include "planar_image.hpp"
+
+namespace apollonian {
+
+class filter_stage {
+public:
+    virtual ~filter_stage() { }
+
+    /* Input pixels needed on each side, beyond those the output covers */
+    virtual int halo() const = 0;
+
+    /* Each output pixel covers factor() x factor() input pixels */
+    virtual int factor() const {
+        return 1;
+    }
+
+    /* Filter one tile.  The result has (tile.rows() - 2*halo())/factor()
+     * rows, and likewise for the columns.  This is called concurrently
+     * from the filter threads, and shouldn't start threads of its own.
+     */
+    virtual planar_image<double>
+    apply_tile(const planar_image<double>& tile) const = 0;
+};
+
+/* The side of the output tiles for the stages.  Every tile filters the
+ * halos of the stages again, so the tiles grow with the padding, to at
+ * least 8 times it.  The input for a tile is then at most 1.25^2 times
+ * its size, whatever the halos.  Small halos get tiles of 256 pixels,
+ * whose intermediate images fit in the L2 or L3 cache.
+ */
+int stages_tile_size(const std::vector<const filter_stage*>& stages);
+
+/* Run the stages in order on the tiles of an image, which must be
+ * padded as for a pipeline of these stages.
+ */
+image_buffer<rgb_color>
+apply_stages(const std::vector<const filter_stage*>& stages,
+             const image_buffer<rgb_color>& data, int num_threads);
+
+class filter_pipeline {
+public:
+    void add(std::unique_ptr<filter_stage> stage);
+
+    /* The padding the input needs on each side */
+    int padding() const;
+
+    /* Input pixels per output pixel, along each axis */
+    int factor() const;
+
+    /* The input size for an output of the given size, and the reverse */
+    int input_size(int output_size) const;
+    int output_size(int input_size) const;
+
+    /* The output is filtered in square tiles of this size, except at
+     * the right and bottom edges.  See stages_tile_size.
+     */
+    int tile_size() const;
+
+    /* The input rectangle that the output rectangle with the given
+     * (half-open) bounds depends on, in place.
+     */
+    void input_rect(int& row0, int& row1, int& col0, int& col1) const;
+
+    /* Filter the rectangle of the output with the given bounds, from
+     * data into result, which are the full input and output images.
+     * This may be called concurrently for disjoint rectangles.
+     */
+    void apply_rect(image_view<const rgb_color> data,
+                    image_view<rgb_color> result,
+                    int row0, int row1, int col0, int col1) const;
+
+    /* Threads to use for filtering; 1 by default */
+    void set_threads(int num_threads);
+
+    image_buffer<rgb_color> apply(const image_buffer<rgb_color>& data) const;
+
+private:
+    std::vector<const filter_stage*> stages() const;
+
+private:
+    std::vector<std::unique_ptr<filter_stage>> stages_;
+    int num_threads_ = 1;
+};
+
+} // apollonian
+
+#endif // FILTER_PIPELINE_HPP
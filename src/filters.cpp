@@ -7,76 +7,63 @@
 
 #include "filters.hpp"
 
-#include <array>
+#include <algorithm>
 #include <cmath>
+#include <complex>
+#include <vector>
+
+#include "concurrency.hpp"
 
 namespace apollonian {
 
-std::array<image_buffer<double>, 3>
-get_channels(const image_buffer<rgb_color>& image) {
-    int rows = image.rows();
-    int cols = image.cols();
-    std::array<image_buffer<double>, 3> channels = {{
-        {rows, cols},
-        {rows, cols},
-        {rows, cols}
-    }};
-    for (int row = 0; row < rows; ++row) {
-        for (int col = 0; col < cols; ++col) {
-            channels[0](row, col) = double(image(row, col).r_) / 0x7fffffff;
-            channels[1](row, col) = double(image(row, col).g_) / 0x7fffffff;
-            channels[2](row, col) = double(image(row, col).b_) / 0x7fffffff;
-        }
-    }
-    return channels;
-}
+/* Output rows in each block of work handed to a thread */
+constexpr int row_block = 16;
 
-inline double normalize_channel(double x) {
-    if (x < 0) x = 0;
-    if (x > 1) x = 1;
-    return x;
-}
+/* Width of the column strips in the vertical passes.  A strip of all
+ * the rows under the kernel for a block of output rows then stays in
+ * the L2 cache while the block is computed.
+ */
+constexpr int column_strip = 512;
 
-image_buffer<rgb_color>
-get_image(const image_buffer<double>& r,
-          const image_buffer<double>& g,
-          const image_buffer<double>& b)
-{
-    int rows = r.rows();
-    int cols = r.cols();
-    image_buffer<rgb_color> image(rows, cols);
-    for (int row = 0; row < rows; ++row) {
-        for (int col = 0; col < cols; ++col) {
-            image(row, col) = rgb_color(
-                normalize_channel(r(row, col)),
-                normalize_channel(g(row, col)),
-                normalize_channel(b(row, col)));
-        }
-    }
-    return image;
-}
+/* A Gaussian blur, applied to the interior of an image at least
+ * shift() pixels away from the edges.  The result is smaller than the
+ * input by shift() pixels on every side.
+ */
+class gaussian_blur {
+public:
+    virtual ~gaussian_blur() { }
 
-class gaussian_kernel {
+    virtual image_buffer<double>
+    apply_2d(const image_buffer<double>& data, int num_threads) const = 0;
+
+    virtual int shift() const = 0;
+};
+
+/* Direct convolution with the Gaussian truncated at the cutoff */
+class gaussian_kernel : public gaussian_blur {
 public:
     gaussian_kernel(double radius, int cutoff);
 
-    template <typename Pixel>
-    image_buffer<Pixel> apply_2d(const image_buffer<Pixel>& data) const;
+    virtual image_buffer<double>
+    apply_2d(const image_buffer<double>& data,
+             int num_threads) const override;
 
     int order() const {
         return coeffs_.size();
     }
 
-    int shift() const {
+    virtual int shift() const override {
         return (coeffs_.size() - 1)/2;
     }
 
 private:
     template <typename Pixel>
-    image_buffer<Pixel> apply_x(const image_buffer<Pixel>& data) const;
+    image_buffer<Pixel> apply_x(const image_buffer<Pixel>& data,
+                                int num_threads) const;
 
     template <typename Pixel>
-    image_buffer<Pixel> apply_y(const image_buffer<Pixel>& data) const;
+    image_buffer<Pixel> apply_y(const image_buffer<Pixel>& data,
+                                int num_threads) const;
 
 private:
     std::vector<double> coeffs_;
@@ -96,54 +83,324 @@ gaussian_kernel::gaussian_kernel(double radius, int cutoff)
     for (int k = 0; k < n; ++k) coeffs_[k] /= total;
 }
 
+/* In both passes, the taps are the outer loop and the inner loop runs
+ * along a row, so that it vectorizes.  Each output pixel still sums
+ * its taps in the same order.
+ */
 template <typename Pixel>
 image_buffer<Pixel>
-gaussian_kernel::apply_x(const image_buffer<Pixel>& data) const {
+gaussian_kernel::apply_x(const image_buffer<Pixel>& data,
+                         int num_threads) const
+{
     int n = order();
     image_buffer<Pixel> result(data.rows(), data.cols() - n + 1);
     int cols = result.cols();
     int rows = result.rows();
-    for (int row = 0; row < rows; ++ row) {
-        for (int col = 0; col < cols; ++col) {
-            Pixel& p = result(row, col);
-            p = Pixel(0);
+    parallel_blocks(num_threads, rows, row_block,
+                    [&](int row_begin, int row_end) {
+        for (int row = row_begin; row < row_end; ++row) {
+            const Pixel* src = data[row];
+            Pixel* dst = result[row];
+            std::fill(dst, dst + cols, Pixel(0));
             for (int k = 0; k < n; ++k) {
-                p += data(row, col + k)*coeffs_[k];
+                double c = coeffs_[k];
+                for (int col = 0; col < cols; ++col) {
+                    dst[col] += src[col + k]*c;
+                }
             }
         }
-    }
+    });
     return result;
 }
 
 template <typename Pixel>
 image_buffer<Pixel>
-gaussian_kernel::apply_y(const image_buffer<Pixel>& data) const {
+gaussian_kernel::apply_y(const image_buffer<Pixel>& data,
+                         int num_threads) const
+{
     int n = order();
     image_buffer<Pixel> result(data.rows() - n + 1, data.cols());
     int cols = result.cols();
     int rows = result.rows();
-    for (int row = 0; row < rows; ++ row) {
-        for (int col = 0; col < cols; ++col) {
-            Pixel& p = result(row, col);
-            p = Pixel(0);
-            for (int k = 0; k < n; ++k) {
-                p += data(row + k, col)*coeffs_[k];
+    parallel_blocks(num_threads, rows, row_block,
+                    [&](int row_begin, int row_end) {
+        for (int col0 = 0; col0 < cols; col0 += column_strip) {
+            int col1 = std::min(cols, col0 + column_strip);
+            for (int row = row_begin; row < row_end; ++row) {
+                Pixel* dst = result[row];
+                std::fill(dst + col0, dst + col1, Pixel(0));
+                for (int k = 0; k < n; ++k) {
+                    const Pixel* src = data[row + k];
+                    double c = coeffs_[k];
+                    for (int col = col0; col < col1; ++col) {
+                        dst[col] += src[col]*c;
+                    }
+                }
             }
         }
+    });
+    return result;
+}
+
+image_buffer<double>
+gaussian_kernel::apply_2d(const image_buffer<double>& data,
+                          int num_threads) const
+{
+    image_buffer<double> result = apply_x(data, num_threads);
+    return apply_y(result, num_threads);
+}
+
+/* The recursive approximation of the Gaussian of Young, van Vliet and
+ * van Ginkel ("Recursive Gabor filtering", 2002): a causal third-order
+ * filter followed by the same filter anti-causally, which costs the
+ * same per pixel for any radius.  Its impulse response is within about
+ * 1% of the peak of the Gaussian with the same variance.
+ *
+ * Unlike the kernel, the recursion doesn't stop at the edges of the
+ * image, so it runs over the whole padded row or column, as if the
+ * image were extended by its edge values.  The state at the start is
+ * then the steady state for the first value, and the state of the
+ * backward pass at the end follows from the forward pass as in Triggs
+ * and Sdika ("Boundary conditions for Young-van Vliet recursive
+ * filtering", 2006).
+ */
+class recursive_gaussian : public gaussian_blur {
+public:
+    recursive_gaussian(double radius, int shift);
+
+    virtual image_buffer<double>
+    apply_2d(const image_buffer<double>& data,
+             int num_threads) const override;
+
+    virtual int shift() const override {
+        return shift_;
+    }
+
+private:
+    image_buffer<double> apply_x(const image_buffer<double>& data,
+                                 int num_threads) const;
+    image_buffer<double> apply_y(const image_buffer<double>& data,
+                                 int num_threads) const;
+
+    /* Set the coefficients for the scale parameter q of the paper,
+     * and return the variance of the resulting blur.
+     */
+    double set_coefficients(double q);
+
+    /* The state of the backward pass past the end of a signal that
+     * continues with its last value x, for the last three values
+     * w0, w1, w2 of the forward pass (w0 last).
+     */
+    void end_state(double x, double w0, double w1, double w2,
+                   double* y) const;
+
+private:
+    int shift_;
+
+    /* w[n] = b_*x[n] + a_[0]*w[n-1] + a_[1]*w[n-2] + a_[2]*w[n-3] */
+    double b_;
+    double a_[3];
+
+    /* end_state is linear in the differences w_k - x */
+    double boundary_[3][3];
+};
+
+recursive_gaussian::recursive_gaussian(double radius, int shift)
+    : shift_{shift}
+{
+    /* The variance increases with q. */
+    double variance = radius*radius;
+    double q_low = 0;
+    double q_high = 1;
+    while (set_coefficients(q_high) < variance) q_high *= 2;
+    for (int k = 0; k < 64; ++k) {
+        double q = 0.5*(q_low + q_high);
+        if (set_coefficients(q) < variance) {
+            q_low = q;
+        } else {
+            q_high = q;
+        }
+    }
+    set_coefficients(q_high);
+
+    /* Rather than using the closed form for the boundary matrix, which
+     * depends on the exact normalization, find its columns by running
+     * the filter past the end of a zero signal for each unit state.
+     * The responses decay at least as fast as exp(-n/radius).
+     */
+    int n = int(std::ceil(40*radius)) + 16;
+    std::vector<double> w(n + 3);
+    for (int j = 0; j < 3; ++j) {
+        double s[3] = {0, 0, 0};
+        s[j] = 1;
+        for (int k = 0; k < n; ++k) {
+            w[k] = a_[0]*s[0] + a_[1]*s[1] + a_[2]*s[2];
+            s[2] = s[1];
+            s[1] = s[0];
+            s[0] = w[k];
+        }
+        double y[3] = {0, 0, 0};
+        for (int k = n - 1; k >= 0; --k) {
+            double v = b_*w[k] + a_[0]*y[0] + a_[1]*y[1] + a_[2]*y[2];
+            y[2] = y[1];
+            y[1] = y[0];
+            y[0] = v;
+        }
+        /* y now holds the backward pass at the first three samples
+         * past the end, nearest first.
+         */
+        for (int i = 0; i < 3; ++i) boundary_[i][j] = y[i];
     }
+}
+
+double recursive_gaussian::set_coefficients(double q) {
+    /* The poles for a scale of 2, from the paper, are raised to the
+     * power 1/q to change the scale.
+     */
+    std::complex<double> d1 = std::pow(std::complex<double>{1.41650, 1.00829},
+                                       1/q);
+    double d3 = std::pow(1.86543, 1/q);
+
+    /* (1 - t/d1)(1 - t/conj(d1))(1 - t/d3) = 1 - a0 t - a1 t^2 - a2 t^3 */
+    double n1 = std::norm(d1);
+    a_[0] = (2*d1.real()*d3 + n1)/(n1*d3);
+    a_[1] = -(2*d1.real() + d3)/(n1*d3);
+    a_[2] = 1/(n1*d3);
+    b_ = 1 - (a_[0] + a_[1] + a_[2]);
+
+    /* From the derivatives of log(b/(1 - a0 t - a1 t^2 - a2 t^3)) in
+     * log(t) at t = 1, doubled for the two passes.
+     */
+    double mean = (a_[0] + 2*a_[1] + 3*a_[2])/b_;
+    return 2*((a_[0] + 4*a_[1] + 9*a_[2])/b_ + mean*mean);
+}
+
+inline void
+recursive_gaussian::end_state(double x, double w0, double w1, double w2,
+                              double* y) const
+{
+    double d[3] = {w0 - x, w1 - x, w2 - x};
+    for (int i = 0; i < 3; ++i) {
+        y[i] = x + boundary_[i][0]*d[0] + boundary_[i][1]*d[1]
+                 + boundary_[i][2]*d[2];
+    }
+}
+
+image_buffer<double>
+recursive_gaussian::apply_x(const image_buffer<double>& data,
+                            int num_threads) const
+{
+    int rows = data.rows();
+    int cols = data.cols();
+    image_buffer<double> result(rows, cols - 2*shift_);
+    parallel_blocks(num_threads, rows, row_block,
+                    [&](int row_begin, int row_end) {
+        std::vector<double> w(cols);
+        for (int row = row_begin; row < row_end; ++row) {
+            const double* x = data[row];
+            double s0 = x[0];
+            double s1 = x[0];
+            double s2 = x[0];
+            for (int col = 0; col < cols; ++col) {
+                double v = b_*x[col] + a_[0]*s0 + a_[1]*s1 + a_[2]*s2;
+                s2 = s1;
+                s1 = s0;
+                s0 = v;
+                w[col] = v;
+            }
+            double y[3];
+            end_state(x[cols - 1], w[cols - 1], w[cols - 2], w[cols - 3], y);
+            s0 = y[0];
+            s1 = y[1];
+            s2 = y[2];
+            double* dst = result[row] - shift_;
+            for (int col = cols - 1; col >= shift_; --col) {
+                double v = b_*w[col] + a_[0]*s0 + a_[1]*s1 + a_[2]*s2;
+                s2 = s1;
+                s1 = s0;
+                s0 = v;
+                if (col < cols - shift_) dst[col] = v;
+            }
+        }
+    });
     return result;
 }
 
-template <typename Pixel>
-image_buffer<Pixel>
-gaussian_kernel::apply_2d(const image_buffer<Pixel>& data) const {
-    image_buffer<Pixel> result = apply_x(data);
-    return apply_y(result);
+image_buffer<double>
+recursive_gaussian::apply_y(const image_buffer<double>& data,
+                            int num_threads) const
+{
+    /* Both passes go a whole row at a time, so that the inner loops
+     * run along rows and vectorize.  The columns are independent, so
+     * each thread takes a strip of them through both passes.
+     */
+    int rows = data.rows();
+    int cols = data.cols();
+    image_buffer<double> w(rows, cols);
+    image_buffer<double> end(3, cols);
+    image_buffer<double> result(rows - 2*shift_, cols);
+    parallel_blocks(num_threads, cols, column_strip,
+                    [&](int col_begin, int col_end) {
+        for (int row = 0; row < rows; ++row) {
+            const double* x = data[row];
+            const double* s0 = row >= 1 ? w[row - 1] : data[0];
+            const double* s1 = row >= 2 ? w[row - 2] : data[0];
+            const double* s2 = row >= 3 ? w[row - 3] : data[0];
+            double* dst = w[row];
+            for (int col = col_begin; col < col_end; ++col) {
+                dst[col] = b_*x[col] + a_[0]*s0[col] + a_[1]*s1[col]
+                         + a_[2]*s2[col];
+            }
+        }
+
+        for (int col = col_begin; col < col_end; ++col) {
+            double y[3];
+            end_state(data(rows - 1, col), w(rows - 1, col),
+                      w(rows - 2, col), w(rows - 3, col), y);
+            for (int i = 0; i < 3; ++i) end(i, col) = y[i];
+        }
+
+        /* The backward pass writes over w, whose rows are no longer
+         * needed once they have been read.
+         */
+        for (int row = rows - 1; row >= shift_; --row) {
+            const double* s0 =
+                row + 1 < rows ? w[row + 1] : end[row + 1 - rows];
+            const double* s1 =
+                row + 2 < rows ? w[row + 2] : end[row + 2 - rows];
+            const double* s2 =
+                row + 3 < rows ? w[row + 3] : end[row + 3 - rows];
+            double* y = w[row];
+            for (int col = col_begin; col < col_end; ++col) {
+                y[col] = b_*y[col] + a_[0]*s0[col] + a_[1]*s1[col]
+                       + a_[2]*s2[col];
+            }
+            if (row < rows - shift_) {
+                std::copy(y + col_begin, y + col_end,
+                          result[row - shift_] + col_begin);
+            }
+        }
+    });
+    return result;
+}
+
+image_buffer<double>
+recursive_gaussian::apply_2d(const image_buffer<double>& data,
+                             int num_threads) const
+{
+    image_buffer<double> result = apply_x(data, num_threads);
+    return apply_y(result, num_threads);
 }
 
-unsharp_mask::unsharp_mask(double radius, double amount) : amount_(amount) {
+unsharp_mask::unsharp_mask(double radius, double amount, blur_method method)
+    : amount_(amount), num_threads_(1)
+{
     int cutoff = int(radius*4);
-    blur_kernel_ = std::make_unique<gaussian_kernel>(radius, cutoff);
+    if (method == blur_method::recursive) {
+        blur_kernel_ = std::make_unique<recursive_gaussian>(radius, cutoff);
+    } else {
+        blur_kernel_ = std::make_unique<gaussian_kernel>(radius, cutoff);
+    }
 }
 
 unsharp_mask::~unsharp_mask() {
@@ -153,38 +410,57 @@ int unsharp_mask::padding() const {
     return blur_kernel_->shift();
 }
 
-template <>
+void unsharp_mask::set_threads(int num_threads) {
+    num_threads_ = std::max(num_threads, 1);
+}
+
+int unsharp_mask::halo() const {
+    return padding();
+}
+
+planar_image<double>
+unsharp_mask::apply_tile(const planar_image<double>& tile) const {
+    return {sharpen(tile.channel(0), 1),
+            sharpen(tile.channel(1), 1),
+            sharpen(tile.channel(2), 1)};
+}
+
 image_buffer<double>
-unsharp_mask::template apply<double>(const image_buffer<double>& data) const {
-    image_buffer<double> data_blurred = blur_kernel_->apply_2d(data);
+unsharp_mask::sharpen(const image_buffer<double>& data,
+                      int num_threads) const
+{
+    image_buffer<double> data_blurred =
+        blur_kernel_->apply_2d(data, num_threads);
     int rows = data_blurred.rows();
     int cols = data_blurred.cols();
     int shift = padding();
     image_buffer<double> result(rows, cols);
-    for (int row = 0; row < rows; ++ row) {
-        for (int col = 0; col < cols; ++col) {
-            double p = data(row + shift, col + shift);
-            double q = data_blurred(row, col);
-            result(row, col) = p + (p - q)*amount_;
+    parallel_blocks(num_threads, rows, row_block,
+                    [&](int row_begin, int row_end) {
+        for (int row = row_begin; row < row_end; ++row) {
+            const double* p = data[row + shift] + shift;
+            const double* q = data_blurred[row];
+            double* dst = result[row];
+            for (int col = 0; col < cols; ++col) {
+                dst[col] = p[col] + (p[col] - q[col])*amount_;
+            }
         }
-    }
+    });
     return result;
 }
 
+template <>
+image_buffer<double>
+unsharp_mask::template apply<double>(const image_buffer<double>& data) const {
+    return sharpen(data, num_threads_);
+}
+
 template <>
 image_buffer<rgb_color>
 unsharp_mask::template apply<rgb_color>(
     const image_buffer<rgb_color>& data) const
 {
-    auto channels = get_channels(data);
-    std::array<image_buffer<double>, 3> result_channels = {
-        apply(channels[0]),
-        apply(channels[1]),
-        apply(channels[2])
-    };
-    return get_image(result_channels[0],
-                     result_channels[1],
-                     result_channels[2]);
+    return apply_stages({this}, data, num_threads_);
 }
 
 } // apollonian
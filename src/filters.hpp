@@ -11,25 +11,63 @@
 #include <memory>
 
 #include "color.hpp"
+#include "filter_pipeline.hpp"
 #include "image_buffer.hpp"
+#include "planar_image.hpp"
 
 namespace apollonian {
 
-class gaussian_kernel;
+class gaussian_blur;
 
-class unsharp_mask {
+/* How the Gaussian blur is computed: by direct convolution with the
+ * Gaussian cut off at 4 times the radius, or recursively, which is
+ * much faster for large radii but only approximately Gaussian (see
+ * recursive_gaussian in filters.cpp).  Either way, the image must be
+ * padded by padding() pixels.
+ *
+ * In a filter_pipeline, which filters a tile at a time, the recursive
+ * blur starts over at the edges of each tile's input, padding() pixels
+ * away from the tile, in both directions.  Near the seams between
+ * tiles, the result then differs slightly from blurring the whole
+ * image: about 0.2% of the pixels of the 8-bit output change by one
+ * level.  The convolution gives the same result either way.
+ */
+enum class blur_method {
+    kernel,
+    recursive
+};
+
+class unsharp_mask : public filter_stage {
 public:
-    unsharp_mask(double radius, double amount);
+    unsharp_mask(double radius, double amount,
+                 blur_method method = blur_method::kernel);
     ~unsharp_mask();
 
     int padding() const;
 
+    /* Threads to use for filtering; 1 by default */
+    void set_threads(int num_threads);
+
+    /* The same as padding() */
+    virtual int halo() const override;
+
+    virtual planar_image<double>
+    apply_tile(const planar_image<double>& tile) const override;
+
+    /* For rgb_color, this runs as a pipeline of one stage, a tile at a
+     * time.
+     */
     template <typename Pixel>
     image_buffer<Pixel> apply(const image_buffer<Pixel>& data) const;
 
 private:
-    std::unique_ptr<gaussian_kernel> blur_kernel_;
+    image_buffer<double> sharpen(const image_buffer<double>& data,
+                                 int num_threads) const;
+
+private:
+    std::unique_ptr<gaussian_blur> blur_kernel_;
     double amount_;
+    int num_threads_;
 };
 
 template <>
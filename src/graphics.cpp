@@ -16,7 +16,9 @@
  */
 #include "graphics.hpp"
 
+#include <cassert>
 #include <cmath>
+#include <vector>
 
 namespace apollonian {
 
@@ -29,12 +31,59 @@ using std::ceil;
 using std::floor;
 using std::sin;
 
+/* draw_circle uses small_circle_coverage below this radius. */
+static constexpr double small_circle_radius = 2;
+
+/* The boundary pixels of larger circles are computed a span at a time
+ * by circle_span_coverage, which is written to be vectorized, but is
+ * slower than compute_circle_boundary_fraction if it isn't.  So it is
+ * only used with wide vectors (see the "native" build option, which
+ * also enables -fno-math-errno, without which std::sqrt can't be
+ * vectorized).
+ */
+#if defined(__AVX2__) || defined(__AVX512F__)
+#define APOLLONIAN_SPAN_COVERAGE 1
+#endif
+
 namespace {
 
 inline double square(double x) {
     return x*x;
 }
 
+/* p += sign*value, wrapping around on overflow.  In the difference
+ * representation of fill_mode::difference, the partial sums of a row
+ * can leave the range of int32_t even though the pixels themselves
+ * can't, and with wrapping arithmetic the pixels still come out right.
+ */
+inline int32_t add_wrapping(int32_t p, int32_t value, int sign) {
+    return int32_t(uint32_t(p) + uint32_t(sign)*uint32_t(value));
+}
+
+inline void add_wrapping(rgb_color& p, const rgb_color& value, int sign) {
+    p.r_ = add_wrapping(p.r_, value.r_, sign);
+    p.g_ = add_wrapping(p.g_, value.g_, sign);
+    p.b_ = add_wrapping(p.b_, value.b_, sign);
+}
+
+/* Add value to a single pixel of a row. */
+inline void add_pixel(rgb_color* row, int cols, fill_mode mode,
+                      int col, const rgb_color& value)
+{
+    if (mode == fill_mode::difference) {
+        add_wrapping(row[col], value, 1);
+        if (col + 1 < cols) add_wrapping(row[col + 1], value, -1);
+    } else {
+        row[col] += value;
+    }
+}
+
+inline void add_pixel(image_view<rgb_color> image, fill_mode mode,
+                      int row, int col, const rgb_color& value)
+{
+    add_pixel(image[row], image.cols(), mode, col, value);
+}
+
 /* Compute the area of the intersection of the first quadrant of a
  * circular disk centered at the origin and an axis-aligned rectangle.
  */
@@ -112,6 +161,248 @@ double compute_circle_boundary_fraction(
         circle_quadrant_area(rr, y0, -x1, y1, -x0);
 }
 
+/* Coverage of the pixels around a circle of radius r < small_circle_radius.
+ *
+ * Rather than intersecting every boundary pixel with the disk, as
+ * compute_circle_boundary_fraction does, this computes, for every pixel
+ * corner (u, v) relative to the center, the area H(u, v) of the part
+ * of the disk with x <= u and y <= v, and takes the area of each pixel
+ * as a difference of the four values at its corners.  H is exact in
+ * closed form, and the only transcendental functions it needs depend
+ * on either u or v alone, so the whole block of pixels costs one atan2
+ * per row and column of corners instead of two atan2 per quadrant per
+ * pixel.
+ *
+ * The result is exact up to rounding.  Since H is at most pi*r*r, the
+ * absolute error of each pixel's coverage is a few ulps of that, i.e.,
+ * below 1e-14, far beneath the resolution of any output format.
+ */
+class small_circle_coverage {
+public:
+    /* The block of pixels [col0, col1] x [row0, row1], which must be
+     * at most max_pixels on each side.
+     */
+    small_circle_coverage(double xc, double yc, double r,
+                          int col0, int col1, int row0, int row1);
+
+    /* The coverage of pixel (x, y) */
+    double operator () (int x, int y) const {
+        return area_[y - row0_][x - col0_];
+    }
+
+    /* Enough for any circle with r < small_circle_radius. */
+    static constexpr int max_pixels = 6;
+
+private:
+    int col0_;
+    int row0_;
+    double area_[max_pixels][max_pixels];
+};
+
+small_circle_coverage::small_circle_coverage(
+        double xc, double yc, double r,
+        int col0, int col1, int row0, int row1)
+    : col0_{col0}, row0_{row0}
+{
+    int cols = col1 - col0 + 1;
+    int rows = row1 - row0 + 1;
+    assert(cols <= max_pixels && rows <= max_pixels);
+
+    double rr = r*r;
+    double quarter_disk = 0.25*acos(-1.0)*rr;
+
+    /* S(x) is the area of the half of the disk above the x axis with
+     * abscissa at most x, clamped to [-r, r].  Then the area of the
+     * disk with abscissa at most x is 2*S(x).
+     */
+    auto S = [=](double x, double y) {
+        /* (x, y) is on the circle, with y >= 0.  The angle is
+         * asin(x/r), but that is badly conditioned near the x axis.
+         */
+        return 0.5*(x*y + rr*atan2(x, y)) + quarter_disk;
+    };
+
+    /* Per column of corners: S(u) */
+    double su[max_pixels + 1];
+    double u[max_pixels + 1];
+    for (int j = 0; j <= cols; ++j) {
+        u[j] = min(max(col0 + j - xc, -r), r);
+        su[j] = S(u[j], sqrt(max(0.0, rr - square(u[j]))));
+    }
+
+    double h[max_pixels + 1][max_pixels + 1];
+    for (int i = 0; i <= rows; ++i) {
+        /* Per row of corners: the chord at height v, from -w to w.  By
+         * symmetry, the part of the disk below -|v| is considered.
+         */
+        double v = row0 + i - yc;
+        double av = min(std::abs(v), r);
+        double w = sqrt(max(0.0, rr - square(av)));
+        double s_plus_w = S(w, av);
+        double s_minus_w = 2*quarter_disk - s_plus_w;
+
+        for (int j = 0; j <= cols; ++j) {
+            /* The area of the disk with x <= u and y <= -|v| */
+            double cap;
+            if (u[j] <= -w) {
+                cap = 0;
+            } else if (u[j] >= w) {
+                cap = s_plus_w - s_minus_w - 2*av*w;
+            } else {
+                cap = su[j] - s_minus_w - av*(u[j] + w);
+            }
+            h[i][j] = v <= 0 ? cap : 2*su[j] - cap;
+        }
+    }
+
+    for (int i = 0; i < rows; ++i) {
+        for (int j = 0; j < cols; ++j) {
+            area_[i][j] = h[i+1][j+1] - h[i+1][j] - h[i][j+1] + h[i][j];
+        }
+    }
+}
+
+#ifdef APOLLONIAN_SPAN_COVERAGE
+
+/* Coefficients of the series
+ *
+ *     2*atan(t) - 2*t/(1 + t*t) = sum_k c(k)*t^(2k + 3),
+ *
+ * namely c(k) = (-1)^k*(4k + 4)/(2k + 3).  The left side is theta - sin(theta)
+ * for t = tan(theta/2).
+ */
+constexpr int segment_series_terms = 16;
+
+constexpr double segment_series_coefficient(int k) {
+    return (k % 2 ? -1 : 1) * (4.0*k + 4)/(2.0*k + 3);
+}
+
+/* Same as circle_quadrant_area, without branches, for
+ * circle_span_coverage.  Instead of the difference of two atan2, the
+ * circular segment cut off by the chord from (xa, ya) to (xb, yb) is
+ * computed from the series above, which is accurate for r at least
+ * small_circle_radius (see circle_span_coverage).
+ */
+inline double circle_quadrant_area_span(
+        double rr,
+        double x0, double y0, double x1, double y1)
+{
+    x0 = max(x0, 0.0);
+    y0 = max(y0, 0.0);
+
+    double x0x0 = square(x0);
+    double y0y0 = square(y0);
+    double x1x1 = square(x1);
+    double y1y1 = square(y1);
+
+    /* The square roots are computed unconditionally, so that they are
+     * not branches.
+     */
+    double sx1 = sqrt(max(0.0, rr - x1x1));
+    double sy0 = sqrt(max(0.0, rr - y0y0));
+    double sx0 = sqrt(max(0.0, rr - x0x0));
+    double sy1 = sqrt(max(0.0, rr - y1y1));
+
+    bool a_on_x1 = x1x1 + y0y0 < rr;
+    double xa = a_on_x1 ? x1 : sy0;
+    double ya = a_on_x1 ? sx1 : y0;
+
+    bool b_on_y1 = x0x0 + y1y1 < rr;
+    double xb = b_on_y1 ? sy1 : x0;
+    double yb = b_on_y1 ? y1 : sx0;
+
+    /* tan(theta/2) for the angle theta between a and b */
+    double t = (xa*yb - xb*ya)/(rr + xa*xb + ya*yb);
+    double tt = t*t;
+    double series = segment_series_coefficient(segment_series_terms - 1);
+    for (int k = segment_series_terms - 2; k >= 0; --k) {
+        series = series*tt + segment_series_coefficient(k);
+    }
+    double segment = 0.5*rr*t*tt*series;
+
+    double area = segment
+        + (xa - x0)*(yb - y0)
+        - 0.5*(xa - xb)*(yb - ya);
+
+    bool empty = x1 <= 0 || y1 <= 0 || x0x0 + y0y0 >= rr;
+    bool full = x1x1 + y1y1 <= rr;
+    return empty ? 0 : full ? (x1 - x0)*(y1 - y0) : area;
+}
+
+/* Pixels per call to circle_span_coverage */
+constexpr int span_chunk = 64;
+
+/* Compute compute_circle_boundary_fraction for the n <= span_chunk
+ * pixels starting at (x0, y0), as one loop without branches, so that
+ * it is vectorized.
+ *
+ * For r >= small_circle_radius, the arc within a pixel subtends an
+ * angle theta of at most 2*asin(sqrt(2)/(2*r)), so t = tan(theta/2) is
+ * at most 0.378, and truncating the series costs less than 1e-14 per
+ * pixel.  Beyond that, the error is rounding, about 1e-16*r per pixel,
+ * where compute_circle_boundary_fraction has about 1e-16*r*r from the
+ * difference of the two angles.
+ */
+void circle_span_coverage(
+        double xc, double yc, double r,
+        int x0, int y0, int n,
+        double* coverage)
+{
+    double rr = r*r;
+    double v0 = y0 - yc;
+    double v1 = v0 + 1;
+
+    for (int k = 0; k < n; ++k) {
+        double u0 = x0 + k - xc;
+        double u1 = u0 + 1;
+        coverage[k] = circle_quadrant_area_span(rr, u0, v0, u1, v1) +
+            circle_quadrant_area_span(rr, -v1, u0, -v0, u1) +
+            circle_quadrant_area_span(rr, -u1, -v1, -u0, -v0) +
+            circle_quadrant_area_span(rr, v0, -u1, v1, -u0);
+    }
+}
+
+#endif
+
+/* Add diff times the coverage of the disk (or of its complement) to the
+ * pixels [x_begin, x_end) of row y.
+ */
+void add_circle_span(image_view<rgb_color> image, fill_mode mode,
+                     double xc, double yc, double r,
+                     int y, int x_begin, int x_end,
+                     const rgb_color& diff, bool complement)
+{
+    rgb_color* row = image[y];
+    int cols = image.cols();
+
+#ifdef APOLLONIAN_SPAN_COVERAGE
+    alignas(64) double coverage[span_chunk];
+    for (int x0 = x_begin; x0 < x_end; x0 += span_chunk) {
+        int n = min(span_chunk, x_end - x0);
+        circle_span_coverage(xc, yc, r, x0, y, n, coverage);
+        if (complement) {
+            for (int k = 0; k < n; ++k) {
+                coverage[k] = 1 - coverage[k];
+            }
+        }
+        if (mode == fill_mode::difference) {
+            for (int k = 0; k < n; ++k) {
+                add_pixel(row, cols, mode, x0 + k, diff*coverage[k]);
+            }
+        } else {
+            for (int k = 0; k < n; ++k) {
+                row[x0 + k] += diff*coverage[k];
+            }
+        }
+    }
+#else
+    for (int x = x_begin; x < x_end; ++x) {
+        double a = compute_circle_boundary_fraction(xc, yc, r, x, y);
+        add_pixel(row, cols, mode, x, diff*(complement ? 1 - a : a));
+    }
+#endif
+}
+
 /* Compute the area of the intersection of a half plane and square pixel
  * with sides of unit length.
  */
@@ -181,65 +472,307 @@ double compute_line_boundary_fraction(
            - 0.5*(xa - xb)*(yb - ya);
 }
 
-} // namespace
+/* Write the pixels [col_begin, col_end) of a row, which all lie
+ * entirely inside the shape being drawn.
+ */
+inline void fill_span(image_view<rgb_color> image, fill_mode mode,
+                      const rgb_color& new_color, const rgb_color& diff,
+                      int row, int col_begin, int col_end)
+{
+    if (mode == fill_mode::replace) {
+        image.fill_row(new_color, row, col_begin, col_end);
+    } else if (mode == fill_mode::add) {
+        image.add_row(diff, row, col_begin, col_end);
+    } else {
+        /* Only the ends of the span are written. */
+        if (row < 0 || row >= image.rows()) return;
+        int cols = image.cols();
+        col_begin = max(col_begin, 0);
+        col_end = min(col_end, cols);
+        if (col_begin >= col_end) return;
+        rgb_color* row_ptr = image[row];
+        add_wrapping(row_ptr[col_begin], diff, 1);
+        if (col_end < cols) add_wrapping(row_ptr[col_end], diff, -1);
+    }
+}
 
-void
-draw_circle(image_buffer<rgb_color>& image,
-            double xc, double yc, double r,
-            const rgb_color& new_color,
-            const rgb_color& old_color)
+/* Same as fill_span, for the rows [row_begin, row_end). */
+inline void fill_block(image_view<rgb_color> image, fill_mode mode,
+                       const rgb_color& new_color, const rgb_color& diff,
+                       int row_begin, int row_end,
+                       int col_begin, int col_end)
+{
+    if (mode == fill_mode::replace) {
+        image.fill_rect(new_color, row_begin, row_end, col_begin, col_end);
+    } else {
+        row_begin = max(row_begin, 0);
+        row_end = min(row_end, image.rows());
+        for (int row = row_begin; row < row_end; ++row) {
+            fill_span(image, mode, new_color, diff, row, col_begin, col_end);
+        }
+    }
+}
+
+
+/* The columns of one row of a shape, clipped to the image: the pixels
+ * [inner_begin_, inner_end_) are entirely inside the shape, and the
+ * ones in [outer_begin_, outer_end_) around them may be partly inside.
+ * Everything else is outside.
+ */
+struct row_spans {
+public:
+    int outer_begin_;
+    int inner_begin_;
+    int inner_end_;
+    int outer_end_;
+};
+
+/* Clip to [0, cols] and put the ends in order. */
+inline row_spans clip_spans(int outer_begin, int inner_begin,
+                            int inner_end, int outer_end, int cols)
+{
+    auto clip = [cols](int x) { return min(max(x, 0), cols); };
+    row_spans spans;
+    spans.outer_begin_ = clip(outer_begin);
+    spans.inner_begin_ = max(clip(inner_begin), spans.outer_begin_);
+    spans.inner_end_ = max(clip(inner_end), spans.inner_begin_);
+    spans.outer_end_ = max(clip(outer_end), spans.inner_end_);
+    return spans;
+}
+
+/* The scanline engine shared by the shapes: draw the rows
+ * [row_begin, row_end) of a shape, or of its complement.  spans(y) is
+ * called for the consecutive rows to get their row_spans, and
+ * add_boundary(y, x_begin, x_end) adds the coverage of the shape (or
+ * of the complement) to the pixels [x_begin, x_end) of row y.
+ */
+template <typename Spans, typename Boundary>
+void draw_scanlines(image_view<rgb_color> image, fill_mode mode,
+                    const rgb_color& new_color, const rgb_color& diff,
+                    int row_begin, int row_end, bool complement,
+                    Spans&& spans, Boundary&& add_boundary)
 {
-    int rows = image.rows();
     int cols = image.cols();
+    for (int y = row_begin; y < row_end; ++y) {
+        row_spans s = spans(y);
+        if (complement) {
+            fill_span(image, mode, new_color, diff, y, 0, s.outer_begin_);
+        }
+        add_boundary(y, s.outer_begin_, s.inner_begin_);
+        if (!complement) {
+            fill_span(image, mode, new_color, diff, y,
+                      s.inner_begin_, s.inner_end_);
+        }
+        add_boundary(y, s.inner_end_, s.outer_end_);
+        if (complement) {
+            fill_span(image, mode, new_color, diff, y, s.outer_end_, cols);
+        }
+    }
+}
 
-    double s = sqrt(0.5);
+/* int(floor(x)) and int(ceil(x)), for x in the range of int.  Without
+ * SSE4.1, std::floor and std::ceil are library calls, which cost more
+ * than everything else in computing a row's spans.
+ */
+inline int floor_int(double x) {
+    int i = int(x);
+    return i - (i > x);
+}
 
-    int ymin{max(0, int(ceil(yc - 0.5 - (r+s))))};
-    if (ymin >= rows) return;
+inline int ceil_int(double x) {
+    int i = int(x);
+    return i + (i < x);
+}
 
-    int ymax{min(rows-1, int(floor(yc - 0.5 + (r+s))))};
-    if (ymax < 0) return;
+/* The columns of a row whose pixel centers are within the given radius
+ * of (xc, yc).
+ *
+ * This is computed directly for every row.  Walking the ends of the
+ * previous row's span a pixel at a time, checking each pixel center,
+ * avoids the square root, but measured slower for all sizes of circle,
+ * because the walk's branches are hard to predict.
+ */
+class circle_row_span {
+public:
+    circle_row_span(double xc, double yc, double radius)
+        : xc_{xc}, yc_{yc}, rr_{square(radius)}
+    {
+    }
 
-    rgb_color diff = new_color - old_color;
+    /* The columns [begin, end) of row y, not clipped to the image. */
+    void row(int y, int& begin, int& end) const {
+        double d = sqrt(max(0.0, rr_ - square(y + 0.5 - yc_)));
+        begin = ceil_int(xc_ - 0.5 - d);
+        end = floor_int(xc_ - 0.5 + d) + 1;
+    }
 
-    for (int y = ymin; y <= ymax; ++y) {
-        double d0 = sqrt(max(0.0, square(r+s) - square(y - yc + 0.5)));
-        double d1;
-        if (r > s) {
-            d1 = sqrt(max(0.0, square(r-s) - square(y - yc + 0.5)));
-        } else {
-            d1 = 0;
+private:
+    double xc_;
+    double yc_;
+    double rr_;
+};
+
+/* The row_spans of a circle of radius r, for draw_scanlines: a pixel is
+ * on the boundary if its center is within sqrt(0.5) of the circle.
+ */
+class circle_scanline {
+public:
+    circle_scanline(double xc, double yc, double r, int cols)
+        : outer_{xc, yc, r + sqrt(0.5)},
+          inner_{xc, yc, r - sqrt(0.5)},
+          has_inner_{r > sqrt(0.5)},
+          cols_{cols}
+    {
+    }
+
+    row_spans operator () (int y) const {
+        int outer_begin;
+        int outer_end;
+        outer_.row(y, outer_begin, outer_end);
+        row_spans spans = clip_spans(outer_begin, outer_end, outer_end,
+                                     outer_end, cols_);
+
+        /* A single inner pixel is left to the boundary. */
+        if (has_inner_) {
+            int inner_begin;
+            int inner_end;
+            inner_.row(y, inner_begin, inner_end);
+            row_spans inner = clip_spans(inner_begin, inner_begin,
+                                         inner_end, inner_end, cols_);
+            if (inner.inner_end_ - inner.inner_begin_ >= 2) {
+                spans.inner_begin_ = inner.inner_begin_;
+                spans.inner_end_ = inner.inner_end_;
+            }
         }
+        return spans;
+    }
 
-        int xmin1{max(0, int(ceil(xc - 0.5 - d1)))};
-        int xmax1{min(cols-1, int(floor(xc - 0.5 + d1)))};
+private:
+    circle_row_span outer_;
+    circle_row_span inner_;
+    bool has_inner_;
+    int cols_;
+};
 
-        int xmin0{max(0, int(ceil(xc - 0.5 - d0)))};
-        int xmax0{min(cols-1, int(floor(xc - 0.5 + d0)))};
+/* draw_circle, restricted to the rows [row_begin, row_end).  Drawing
+ * a circle in several pieces this way gives exactly the same result as
+ * drawing it all at once.
+ */
+void draw_circle_rows(image_view<rgb_color> image,
+                      double xc, double yc, double r,
+                      const rgb_color& new_color,
+                      const rgb_color& old_color,
+                      fill_mode mode,
+                      int row_begin, int row_end)
+{
+    int cols = image.cols();
 
-        if (xmin1 < xmax1) {
-            for (int x = xmin0; x < xmin1; ++x) {
-                double a = compute_circle_boundary_fraction(xc, yc, r, x, y);
-                image(y, x) += diff*a;
-            }
-            image.fill_row(new_color, y, xmin1, xmax1+1);
-            for (int x = xmax1+1; x <= xmax0; ++x) {
-                double a = compute_circle_boundary_fraction(xc, yc, r, x, y);
-                image(y, x) += diff*a;
-            }
-        } else {
-            for (int x = xmin0; x <= xmax0; ++x) {
-                double a = compute_circle_boundary_fraction(xc, yc, r, x, y);
-                image(y, x) += diff*a;
+    double s = sqrt(0.5);
+
+    int ymin{max(row_begin, int(ceil(yc - 0.5 - (r+s))))};
+    if (ymin >= row_end) return;
+
+    int ymax{min(row_end-1, int(floor(yc - 0.5 + (r+s))))};
+    if (ymax < row_begin) return;
+
+    rgb_color diff = new_color - old_color;
+    circle_scanline spans{xc, yc, r, cols};
+
+    if (r < small_circle_radius) {
+        int xmin{max(0, int(ceil(xc - 0.5 - (r+s))))};
+        int xmax{min(cols-1, int(floor(xc - 0.5 + (r+s))))};
+        if (xmin > xmax) return;
+        small_circle_coverage coverage{xc, yc, r, xmin, xmax, ymin, ymax};
+        draw_scanlines(image, mode, new_color, diff, ymin, ymax+1, false,
+                       spans, [&](int y, int x_begin, int x_end) {
+            for (int x = x_begin; x < x_end; ++x) {
+                add_pixel(image, mode, y, x, diff*coverage(x, y));
             }
+        });
+    } else {
+        draw_scanlines(image, mode, new_color, diff, ymin, ymax+1, false,
+                       spans, [&](int y, int x_begin, int x_end) {
+            add_circle_span(image, mode, xc, yc, r, y, x_begin, x_end,
+                            diff, false);
+        });
+    }
+}
+
+/* Rows per band in draw_circles */
+constexpr int band_rows = 16;
+
+} // namespace
+
+void
+draw_circle(image_view<rgb_color> image,
+            double xc, double yc, double r,
+            const rgb_color& new_color,
+            const rgb_color& old_color,
+            fill_mode mode)
+{
+    draw_circle_rows(image, xc, yc, r, new_color, old_color, mode,
+                     0, image.rows());
+}
+
+void
+draw_circles(image_view<rgb_color> image,
+             const std::vector<circle_draw>& circles,
+             fill_mode mode)
+{
+    int rows = image.rows();
+    int num_bands = (rows + band_rows - 1)/band_rows;
+    int num_circles = circles.size();
+    if (num_bands == 0) return;
+
+    /* The bands [band_begin[k], band_end[k]) touched by circle k */
+    std::vector<int> band_begin(num_circles);
+    std::vector<int> band_end(num_circles);
+    double s = sqrt(0.5);
+    for (int k = 0; k < num_circles; ++k) {
+        const circle_draw& c = circles[k];
+        int ymin{max(0, int(ceil(c.yc_ - 0.5 - (c.r_+s))))};
+        int ymax{min(rows-1, int(floor(c.yc_ - 0.5 + (c.r_+s))))};
+        band_begin[k] = ymin/band_rows;
+        band_end[k] = ymin <= ymax ? ymax/band_rows + 1 : band_begin[k];
+    }
+
+    /* Counting sort of the (band, circle) pairs by band, which keeps
+     * the circles of each band in their original order.
+     */
+    std::vector<int> offsets(num_bands + 1, 0);
+    for (int k = 0; k < num_circles; ++k) {
+        for (int band = band_begin[k]; band < band_end[k]; ++band) {
+            ++offsets[band + 1];
+        }
+    }
+    for (int band = 0; band < num_bands; ++band) {
+        offsets[band + 1] += offsets[band];
+    }
+    std::vector<int> order(offsets[num_bands]);
+    std::vector<int> next(offsets.begin(), offsets.end() - 1);
+    for (int k = 0; k < num_circles; ++k) {
+        for (int band = band_begin[k]; band < band_end[k]; ++band) {
+            order[next[band]++] = k;
+        }
+    }
+
+    for (int band = 0; band < num_bands; ++band) {
+        int row_begin = band*band_rows;
+        int row_end = min(rows, row_begin + band_rows);
+        for (int i = offsets[band]; i < offsets[band + 1]; ++i) {
+            const circle_draw& c = circles[order[i]];
+            draw_circle_rows(image, c.xc_, c.yc_, c.r_,
+                             c.new_color_, c.old_color_, mode,
+                             row_begin, row_end);
         }
     }
 }
 
-void draw_circle_complement(image_buffer<rgb_color>& image,
+void draw_circle_complement(image_view<rgb_color> image,
                             double xc, double yc, double r,
                             const rgb_color& new_color,
-                            const rgb_color& old_color)
+                            const rgb_color& old_color,
+                            fill_mode mode)
 {
     int rows = image.rows();
     int cols = image.cols();
@@ -254,52 +787,30 @@ void draw_circle_complement(image_buffer<rgb_color>& image,
 
     rgb_color diff = new_color - old_color;
 
-    for (int y = 0; y < ymin; ++y) {
-        image.fill_row(new_color, y, 0, cols);
-    }
-    for (int y = ymin; y <= ymax; ++y) {
-        double d0 = sqrt(max(0.0, square(r+s) - square(y - yc + 0.5)));
-        double d1;
-        if (r > s) {
-            d1 = sqrt(max(0.0, square(r-s) - square(y - yc + 0.5)));
-        } else {
-            d1 = 0;
+    auto add_boundary = [&](int y, int x_begin, int x_end) {
+        if (r >= small_circle_radius) {
+            add_circle_span(image, mode, xc, yc, r, y, x_begin, x_end,
+                            diff, true);
+            return;
         }
-
-        int xmin1{max(0, int(ceil(xc - 0.5 - d1)))};
-        int xmax1{min(cols-1, int(floor(xc - 0.5 + d1)))};
-
-        int xmin0{max(0, int(ceil(xc - 0.5 - d0)))};
-        int xmax0{min(cols-1, int(floor(xc - 0.5 + d0)))};
-
-        image.fill_row(new_color, y, 0, xmin0);
-        if (xmin1 < xmax1) {
-            for (int x = xmin0; x < xmin1; ++x) {
-                double a = compute_circle_boundary_fraction(xc, yc, r, x, y);
-                image(y, x) += diff*(1-a);
-            }
-            for (int x = xmax1+1; x <= xmax0; ++x) {
-                double a = compute_circle_boundary_fraction(xc, yc, r, x, y);
-                image(y, x) += diff*(1-a);
-            }
-        } else {
-            for (int x = xmin0; x <= xmax0; ++x) {
-                double a = compute_circle_boundary_fraction(xc, yc, r, x, y);
-                image(y, x) += diff*(1-a);
-            }
+        for (int x = x_begin; x < x_end; ++x) {
+            double a = compute_circle_boundary_fraction(xc, yc, r, x, y);
+            add_pixel(image, mode, y, x, diff*(1-a));
         }
-        image.fill_row(new_color, y, xmax0+1, cols);
-    }
-    for (int y = ymax+1; y < rows; ++y) {
-        image.fill_row(new_color, y, 0, cols);
-    }
+    };
+
+    fill_block(image, mode, new_color, diff, 0, ymin, 0, cols);
+    draw_scanlines(image, mode, new_color, diff, ymin, ymax+1, true,
+                   circle_scanline{xc, yc, r, cols}, add_boundary);
+    fill_block(image, mode, new_color, diff, ymax+1, rows, 0, cols);
 }
 
 void
-draw_half_plane(image_buffer<rgb_color>& image,
+draw_half_plane(image_view<rgb_color> image,
                 double a, double b, double c,
                 const rgb_color& new_color,
-                const rgb_color& old_color)
+                const rgb_color& old_color,
+                fill_mode mode)
 {
     int rows = image.rows();
     int cols = image.cols();
@@ -314,59 +825,62 @@ draw_half_plane(image_buffer<rgb_color>& image,
     if (a == 0) {
         int y = int(floor(-c/b));
         if (b < 0) {
-            image.fill_rect(new_color, y+1, rows, 0, cols);
+            fill_block(image, mode, new_color, diff, y+1, rows, 0, cols);
         } else {
-            image.fill_rect(new_color, 0, y, 0, cols);
+            fill_block(image, mode, new_color, diff, 0, y, 0, cols);
         }
         if (0 <= y && y < rows) {
             for (int x = 0; x < cols; ++x) {
                 double f = compute_line_boundary_fraction(a, b, c, x, y);
-                image(y, x) += diff*f;
-            }
-        }
-    } else if (a < 0) {
-        if (b < 0) {
-            for (int y = 0; y < rows; ++y) {
-                int x0 = max(0, int(floor(-(c + b*(y+1))/a)));
-                int x1 = min(cols, int(ceil(-(c + b*y)/a)));
-                for (int x = x0; x < x1; ++x) {
-                    double f = compute_line_boundary_fraction(a, b, c, x, y);
-                    image(y, x) += diff*f;
-                }
-                image.fill_row(new_color, y, x1, cols);
-            }
-        } else {
-            for (int y = 0; y < rows; ++y) {
-                int x0 = max(0, int(floor(-(c + b*y)/a)));
-                int x1 = min(cols, int(ceil(-(c + b*(y+1))/a)));
-                for (int x = x0; x < x1; ++x) {
-                    double f = compute_line_boundary_fraction(a, b, c, x, y);
-                    image(y, x) += diff*f;
-                }
-                image.fill_row(new_color, y, x1, cols);
+                add_pixel(image, mode, y, x, diff*f);
             }
         }
     } else {
-        if (b < 0) {
-            for (int y = 0; y < rows; ++y) {
-                int x0 = max(0, int(floor(-(c + b*y)/a)));
-                int x1 = min(cols, int(ceil(-(c + b*(y+1))/a)));
-                image.fill_row(new_color, y, 0, x0);
-                for (int x = x0; x < x1; ++x) {
-                    double f = compute_line_boundary_fraction(a, b, c, x, y);
-                    image(y, x) += diff*f;
-                }
+        /* Row y meets the line between x = t(y) and x = t(y+1), and the
+         * half plane is to the right of it if a < 0.
+         */
+        double t1 = -c/a;
+        auto spans = [&](int y) {
+            double t0 = t1;
+            t1 = -(c + b*(y+1))/a;
+            int x0 = floor_int(min(t0, t1));
+            int x1 = ceil_int(max(t0, t1));
+            if (a < 0) {
+                return clip_spans(x0, x1, cols, cols, cols);
+            } else {
+                return clip_spans(0, 0, x0, x1, cols);
             }
-        } else {
-            for (int y = 0; y < rows; ++y) {
-                int x0 = max(0, int(floor(-(c + b*(y+1))/a)));
-                int x1 = min(cols, int(ceil(-(c + b*y)/a)));
-                image.fill_row(new_color, y, 0, x0);
-                for (int x = x0; x < x1; ++x) {
-                    double f = compute_line_boundary_fraction(a, b, c, x, y);
-                    image(y, x) += diff*f;
-                }
+        };
+        draw_scanlines(image, mode, new_color, diff, 0, rows, false, spans,
+                       [&](int y, int x_begin, int x_end) {
+            for (int x = x_begin; x < x_end; ++x) {
+                double f = compute_line_boundary_fraction(a, b, c, x, y);
+                add_pixel(image, mode, y, x, diff*f);
             }
+        });
+    }
+}
+
+void
+to_differences(image_view<rgb_color> image) {
+    int rows = image.rows();
+    int cols = image.cols();
+    for (int y = 0; y < rows; ++y) {
+        rgb_color* row = image[y];
+        for (int x = cols - 1; x > 0; --x) {
+            add_wrapping(row[x], row[x - 1], -1);
+        }
+    }
+}
+
+void
+from_differences(image_view<rgb_color> image) {
+    int rows = image.rows();
+    int cols = image.cols();
+    for (int y = 0; y < rows; ++y) {
+        rgb_color* row = image[y];
+        for (int x = 1; x < cols; ++x) {
+            add_wrapping(row[x], row[x - 1], 1);
         }
     }
 }
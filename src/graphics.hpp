@@ -7,7 +7,7 @@
 
 /* This module implements some relatively low-level graphics primitives,
  * namely drawing the various types of generalized circle into an
- * image_buffer.
+ * image_view.
  *
  * All coordinates in the interface are in image pixels, unless noted
  * otherwise.
@@ -28,32 +28,86 @@
 #ifndef GRAPHICS_HPP
 #define GRAPHICS_HPP
 
+#include <vector>
+
 #include "color.hpp"
 #include "image_buffer.hpp"
 
 namespace apollonian {
 
+/* How the pixels entirely inside a shape are written.  With
+ * fill_mode::add, every pixel only receives the difference
+ * new_color - old_color, so the image can start out blank and be added
+ * to the real one afterward.
+ *
+ * With fill_mode::difference, the image holds the differences between
+ * adjacent pixels of each row (see to_differences), and a span of
+ * pixels inside the shape only writes the difference at its two ends,
+ * so drawing a shape costs time proportional to its height and
+ * boundary rather than its area.  The drawing is additive, as with
+ * fill_mode::add.
+ */
+enum class fill_mode {
+    replace,
+    add,
+    difference,
+};
+
+/* Convert the image to the representation of fill_mode::difference,
+ * where each pixel holds the difference from the one to its left.
+ */
+void
+to_differences(image_view<rgb_color> image);
+
+/* The inverse of to_differences: the prefix sum of each row. */
+void
+from_differences(image_view<rgb_color> image);
+
 /* Draw the circle with radius r centered at (xc, yc). */
 void
-draw_circle(image_buffer<rgb_color>& image,
+draw_circle(image_view<rgb_color> image,
             double xc, double yc, double r,
             const rgb_color& new_color,
-            const rgb_color& old_color);
+            const rgb_color& old_color,
+            fill_mode mode = fill_mode::replace);
+
+/* The arguments of one draw_circle call. */
+struct circle_draw {
+public:
+    double xc_;
+    double yc_;
+    double r_;
+    rgb_color new_color_;
+    rgb_color old_color_;
+};
+
+/* Same as calling draw_circle for each of the circles in order, but
+ * done one band of rows at a time, so that the writes stay within a
+ * small part of the image.  Each band draws its part of every circle
+ * that touches it, in the original order, so within any pixel the
+ * circles are still drawn in order, and the result is the same.
+ */
+void
+draw_circles(image_view<rgb_color> image,
+             const std::vector<circle_draw>& circles,
+             fill_mode mode = fill_mode::replace);
 
 /* Draw the complement of the circle with radius r centered at (xc, yc).
  */
 void
-draw_circle_complement(image_buffer<rgb_color>& image,
+draw_circle_complement(image_view<rgb_color> image,
                        double xc, double yc, double r,
                        const rgb_color& new_color,
-                       const rgb_color& old_color);
+                       const rgb_color& old_color,
+                       fill_mode mode = fill_mode::replace);
 
 /* Draw the half-plane a*x + b*y + c <= 0. */
 void
-draw_half_plane(image_buffer<rgb_color>& image,
+draw_half_plane(image_view<rgb_color> image,
                 double a, double b, double c,
                 const rgb_color& new_color,
-                const rgb_color& old_color);
+                const rgb_color& old_color,
+                fill_mode mode = fill_mode::replace);
 
 } // apollonian
 
@@ -8,12 +8,24 @@
 #ifndef IMAGE_BUFFER_HPP
 #define IMAGE_BUFFER_HPP
 
+#include <cstddef>
 #include <cstring>
 
-#include <vector>
+#include "image_storage.hpp"
 
 namespace apollonian {
 
+/* Every row of an image_buffer starts at an address aligned to this
+ * many bytes, and is padded to a multiple of it, so that rows can be
+ * processed with aligned vector loads and stores of any width up to
+ * 512 bits.
+ */
+constexpr std::size_t row_alignment = 64;
+
+constexpr std::size_t gcd(std::size_t a, std::size_t b) {
+    return b == 0 ? a : gcd(b, a % b);
+}
+
 template <typename Pixel>
 void fill_row(const Pixel& value, Pixel* begin, Pixel* end) {
     if (end <= begin) return;
@@ -32,7 +44,7 @@ void fill_row(const Pixel& value, Pixel* begin, Pixel* end) {
 
 template <typename Pixel>
 void fill_rect(const Pixel& value, Pixel* data,
-               int rows, int cols, int stride)
+               int rows, int cols, std::ptrdiff_t stride)
 {
     if (rows <= 0) return;
 
@@ -45,10 +57,61 @@ void fill_rect(const Pixel& value, Pixel* data,
     }
 }
 
+/* A rectangular region of an image_buffer, or of another view, which
+ * doesn't own its pixels.  Copying a view is cheap, and the copy refers
+ * to the same pixels.  Pixel may be const, for read-only views.
+ */
+template <typename Pixel>
+class image_view {
+public:
+    image_view() = default;
+    image_view(Pixel* data, int rows, int cols, int stride);
+
+    /* Read-only views of writable ones */
+    template <typename Other>
+    image_view(const image_view<Other>& other);
+
+    Pixel& operator () (int row, int col) const;
+    Pixel* operator [] (int row) const;
+
+    /* The view of rows [row0, row0 + rows) and columns [col0, col0 +
+     * cols), clipped to this one.
+     */
+    image_view window(int col0, int row0, int cols, int rows) const;
+
+    void fill_row(const Pixel& value, int row,
+                  int col_begin, int col_end) const;
+    void add_row(const Pixel& value, int row,
+                 int col_begin, int col_end) const;
+    void fill_rect(const Pixel& value, int row_begin, int row_end,
+                   int col_begin, int col_end) const;
+    void fill(const Pixel& value) const;
+
+    int rows() const;
+    int cols() const;
+    int stride() const;
+
+private:
+    Pixel* data_ = nullptr;
+    int rows_ = 0;
+    int cols_ = 0;
+    int stride_ = 0;
+};
+
+/* An image, with pixels stored row by row.  Indices are ints, but
+ * offsets are computed in std::size_t, so images can be larger than
+ * 2^31 pixels.
+ */
 template <typename Pixel>
 class image_buffer {
 public:
-    image_buffer(int rows, int cols);
+    image_buffer(int rows, int cols, const storage_options& options = {});
+
+    /* Copies are always on the heap. */
+    image_buffer(const image_buffer& other);
+    image_buffer(image_buffer&& other) = default;
+    image_buffer& operator = (const image_buffer& other);
+    image_buffer& operator = (image_buffer&& other) = default;
 
     const Pixel& operator () (int row, int col) const;
     Pixel& operator () (int row, int col);
@@ -56,8 +119,15 @@ public:
     const Pixel* operator [] (int row) const;
     Pixel* operator [] (int row);
 
+    image_view<Pixel> view();
+    image_view<const Pixel> view() const;
+    operator image_view<Pixel> ();
+    operator image_view<const Pixel> () const;
+
     void fill_row(const Pixel& value, int row,
                   int col_begin, int col_end);
+    void add_row(const Pixel& value, int row,
+                 int col_begin, int col_end);
     void fill_rect(const Pixel& value, int row_begin, int row_end,
                    int col_begin, int col_end);
     void fill(const Pixel& value);
@@ -65,47 +135,62 @@ public:
     int rows() const;
     int cols() const;
 
+    /* Distance between the starts of consecutive rows, in pixels.  The
+     * pixels between cols() and stride() in each row are padding, and
+     * can be written freely by vectorized code, but are otherwise
+     * ignored.
+     */
+    int stride() const;
+
+    /* The stride of a buffer with the given number of columns */
+    static int padded_cols(int cols);
+
+private:
+    Pixel* data() const;
+
 private:
     int rows_;
     int cols_;
-    std::vector<Pixel> data_;
+    int stride_;
+    image_storage storage_;
 };
 
 template <typename Pixel>
-image_buffer<Pixel>::image_buffer(int rows, int cols)
-    : rows_{rows}, cols_{cols}
+image_view<Pixel>::image_view(Pixel* data, int rows, int cols, int stride)
+    : data_{data}, rows_{rows}, cols_{cols}, stride_{stride}
 {
-    // There's a weird compilation error when this is in the
-    // initialization list, when Pixel is `double`.
-    data_.resize(rows*cols);
 }
 
 template <typename Pixel>
-const Pixel&
-image_buffer<Pixel>::operator () (int row, int col) const {
-    return data_[row*cols_ + col];
+template <typename Other>
+image_view<Pixel>::image_view(const image_view<Other>& other)
+    : data_{other[0]}, rows_{other.rows()}, cols_{other.cols()},
+      stride_{other.stride()}
+{
 }
 
 template <typename Pixel>
-Pixel&
-image_buffer<Pixel>::operator () (int row, int col) {
-    return data_[row*cols_ + col];
+Pixel& image_view<Pixel>::operator () (int row, int col) const {
+    return data_[std::ptrdiff_t(row)*stride_ + col];
 }
 
 template <typename Pixel>
-const Pixel* image_buffer<Pixel>::operator [] (int row) const {
-    return data_.data() + row*cols_;
+Pixel* image_view<Pixel>::operator [] (int row) const {
+    return data_ + std::ptrdiff_t(row)*stride_;
 }
 
 template <typename Pixel>
-Pixel* image_buffer<Pixel>::operator [] (int row) {
-    return data_.data() + row*cols_;
+image_view<Pixel>
+image_view<Pixel>::window(int col0, int row0, int cols, int rows) const {
+    if (col0 + cols > cols_) cols = cols_ - col0;
+    if (row0 + rows > rows_) rows = rows_ - row0;
+    return {data_ + std::ptrdiff_t(row0)*stride_ + col0, rows, cols, stride_};
 }
 
 template <typename Pixel>
-void image_buffer<Pixel>::fill_row(
+void image_view<Pixel>::fill_row(
         const Pixel& value, int row,
-        int col_begin, int col_end)
+        int col_begin, int col_end) const
 {
     if (row < 0 || row >= rows_) return;
     if (col_begin < 0) col_begin = 0;
@@ -116,24 +201,165 @@ void image_buffer<Pixel>::fill_row(
 }
 
 template <typename Pixel>
-void image_buffer<Pixel>::fill_rect(
+void image_view<Pixel>::add_row(
+        const Pixel& value, int row,
+        int col_begin, int col_end) const
+{
+    if (row < 0 || row >= rows_) return;
+    if (col_begin < 0) col_begin = 0;
+    if (col_end > cols_) col_end = cols_;
+
+    Pixel* row_ptr = operator [] (row);
+    for (int col = col_begin; col < col_end; ++col) {
+        row_ptr[col] += value;
+    }
+}
+
+template <typename Pixel>
+void image_view<Pixel>::fill_rect(
         const Pixel& value,
         int row_begin, int row_end,
-        int col_begin, int col_end)
+        int col_begin, int col_end) const
 {
     if (row_begin < 0) row_begin = 0;
     if (row_end > rows_) row_end = rows_;
     if (col_begin < 0) col_begin = 0;
     if (col_end > cols_) col_end = cols_;
 
-    apollonian::fill_rect(value, data_.data() + row_begin*cols_ + col_begin,
+    Pixel* begin = data_ + std::ptrdiff_t(row_begin)*stride_ + col_begin;
+    apollonian::fill_rect(value, begin,
                           row_end - row_begin, col_end - col_begin,
-                          cols_*sizeof(Pixel));
+                          stride_*sizeof(Pixel));
+}
+
+template <typename Pixel>
+void image_view<Pixel>::fill(const Pixel& value) const {
+    fill_rect(value, 0, rows_, 0, cols_);
+}
+
+template <typename Pixel>
+int image_view<Pixel>::rows() const {
+    return rows_;
+}
+
+template <typename Pixel>
+int image_view<Pixel>::cols() const {
+    return cols_;
+}
+
+template <typename Pixel>
+int image_view<Pixel>::stride() const {
+    return stride_;
+}
+
+template <typename Pixel>
+image_buffer<Pixel>::image_buffer(int rows, int cols,
+                                  const storage_options& options)
+    : rows_{rows}, cols_{cols}, stride_{padded_cols(cols)},
+      storage_{std::size_t(rows)*stride_*sizeof(Pixel), row_alignment,
+               options}
+{
+}
+
+template <typename Pixel>
+image_buffer<Pixel>::image_buffer(const image_buffer& other)
+    : rows_{other.rows_}, cols_{other.cols_}, stride_{other.stride_},
+      storage_{other.storage_.size(), row_alignment}
+{
+    if (storage_.size() > 0) {
+        memcpy(storage_.data(), other.storage_.data(), storage_.size());
+    }
+}
+
+template <typename Pixel>
+image_buffer<Pixel>&
+image_buffer<Pixel>::operator = (const image_buffer& other) {
+    if (this != &other) *this = image_buffer(other);
+    return *this;
+}
+
+template <typename Pixel>
+Pixel* image_buffer<Pixel>::data() const {
+    return static_cast<Pixel*>(storage_.data());
+}
+
+template <typename Pixel>
+int image_buffer<Pixel>::padded_cols(int cols) {
+    /* The fewest pixels taking up a multiple of row_alignment bytes */
+    constexpr int step = row_alignment/gcd(sizeof(Pixel), row_alignment);
+    return (cols + step - 1)/step*step;
+}
+
+template <typename Pixel>
+const Pixel&
+image_buffer<Pixel>::operator () (int row, int col) const {
+    return data()[std::size_t(row)*stride_ + col];
+}
+
+template <typename Pixel>
+Pixel&
+image_buffer<Pixel>::operator () (int row, int col) {
+    return data()[std::size_t(row)*stride_ + col];
+}
+
+template <typename Pixel>
+const Pixel* image_buffer<Pixel>::operator [] (int row) const {
+    return data() + std::size_t(row)*stride_;
+}
+
+template <typename Pixel>
+Pixel* image_buffer<Pixel>::operator [] (int row) {
+    return data() + std::size_t(row)*stride_;
+}
+
+template <typename Pixel>
+image_view<Pixel> image_buffer<Pixel>::view() {
+    return {data(), rows_, cols_, stride_};
+}
+
+template <typename Pixel>
+image_view<const Pixel> image_buffer<Pixel>::view() const {
+    return {data(), rows_, cols_, stride_};
+}
+
+template <typename Pixel>
+image_buffer<Pixel>::operator image_view<Pixel> () {
+    return view();
+}
+
+template <typename Pixel>
+image_buffer<Pixel>::operator image_view<const Pixel> () const {
+    return view();
+}
+
+template <typename Pixel>
+void image_buffer<Pixel>::fill_row(
+        const Pixel& value, int row,
+        int col_begin, int col_end)
+{
+    view().fill_row(value, row, col_begin, col_end);
+}
+
+template <typename Pixel>
+void image_buffer<Pixel>::add_row(
+        const Pixel& value, int row,
+        int col_begin, int col_end)
+{
+    view().add_row(value, row, col_begin, col_end);
+}
+
+template <typename Pixel>
+void image_buffer<Pixel>::fill_rect(
+        const Pixel& value,
+        int row_begin, int row_end,
+        int col_begin, int col_end)
+{
+    view().fill_rect(value, row_begin, row_end, col_begin, col_end);
 }
 
 template <typename Pixel>
 void image_buffer<Pixel>::fill(const Pixel& value) {
-    apollonian::fill_row(value, data_.data(), data_.data() + data_.size());
+    apollonian::fill_row(value, data(), data() + std::size_t(rows_)*stride_);
 }
 
 template <typename Pixel>
@@ -146,6 +372,11 @@ int image_buffer<Pixel>::cols() const {
     return cols_;
 }
 
+template <typename Pixel>
+int image_buffer<Pixel>::stride() const {
+    return stride_;
+}
+
 } // apollonian
 
 #endif // IMAGE_BUFFER_HPP
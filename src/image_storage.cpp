@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Copyright 2024 Darsh Ranjan.
+ *
+ * This file is part of super-apollonian-cpp.
+ */
+
+#include "image_storage.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace apollonian {
+
+namespace {
+
+[[noreturn]] void throw_errno(const std::string& what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+} // namespace
+
+image_storage::image_storage(std::size_t size, std::size_t align,
+                             const storage_options& options)
+    : size_{size}
+{
+    if (size == 0) return;
+
+    if (options.filename_.empty() && !options.huge_pages_) {
+        /* Over-allocate and round up, as operator new doesn't take an
+         * alignment before C++17.
+         */
+        allocation_ = ::operator new(size + align);
+        std::uintptr_t p = reinterpret_cast<std::uintptr_t>(allocation_);
+        p = (p + align - 1) & ~std::uintptr_t(align - 1);
+        data_ = reinterpret_cast<void*>(p);
+        std::memset(data_, 0, size);
+        return;
+    }
+
+    /* Mappings are page-aligned, which is plenty. */
+    int fd = -1;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (!options.filename_.empty()) {
+        fd = open(options.filename_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) throw_errno("open " + options.filename_);
+        if (ftruncate(fd, size) != 0) {
+            int error = errno;
+            close(fd);
+            errno = error;
+            throw_errno("ftruncate " + options.filename_);
+        }
+        flags = MAP_SHARED;
+    }
+
+    allocation_ = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    int error = errno;
+    if (fd >= 0) close(fd);
+    if (allocation_ == MAP_FAILED) {
+        allocation_ = nullptr;
+        errno = error;
+        throw_errno("mmap");
+    }
+    mapped_ = true;
+    data_ = allocation_;
+
+#ifdef MADV_HUGEPAGE
+    /* Only a hint, which not every kernel or file system honors */
+    if (options.huge_pages_) madvise(allocation_, size, MADV_HUGEPAGE);
+#endif
+}
+
+image_storage::~image_storage() {
+    release();
+}
+
+image_storage::image_storage(image_storage&& other)
+    : data_{other.data_}, size_{other.size_},
+      mapped_{other.mapped_}, allocation_{other.allocation_}
+{
+    other.data_ = nullptr;
+    other.size_ = 0;
+    other.mapped_ = false;
+    other.allocation_ = nullptr;
+}
+
+image_storage& image_storage::operator = (image_storage&& other) {
+    if (this != &other) {
+        release();
+        data_ = other.data_;
+        size_ = other.size_;
+        mapped_ = other.mapped_;
+        allocation_ = other.allocation_;
+        other.data_ = nullptr;
+        other.size_ = 0;
+        other.mapped_ = false;
+        other.allocation_ = nullptr;
+    }
+    return *this;
+}
+
+void image_storage::release() {
+    if (mapped_) {
+        munmap(allocation_, size_);
+    } else {
+        ::operator delete(allocation_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+    mapped_ = false;
+    allocation_ = nullptr;
+}
+
+} // apollonian
@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Copyright 2024 Darsh Ranjan.
+ *
+ * This file is part of super-apollonian-cpp.
+ */
+
+/* Backing memory for image_buffer.
+ *
+ * Ordinary images are allocated on the heap.  For very large images,
+ * which may not fit in memory, the pixels can instead live in a file
+ * mapped into memory, so that the kernel pages them in and out as they
+ * are drawn.  Anonymous mappings can also be backed by huge pages, which
+ * saves TLB misses when the rendering jumps between distant rows.
+ */
+#ifndef IMAGE_STORAGE_HPP
+#define IMAGE_STORAGE_HPP
+
+#include <cstddef>
+#include <string>
+
+namespace apollonian {
+
+/* Where to put the pixels of an image */
+struct storage_options {
+public:
+    /* If nonempty, the file to map the pixels from.  It is created or
+     * truncated, and left behind afterward.
+     */
+    std::string filename_;
+
+    /* Ask for transparent huge pages */
+    bool huge_pages_ = false;
+};
+
+/* A block of zero-initialized memory aligned to at least align bytes,
+ * which is released on destruction.  Errors are reported by throwing
+ * std::system_error.
+ */
+class image_storage {
+public:
+    image_storage() = default;
+    image_storage(std::size_t size, std::size_t align,
+                  const storage_options& options = {});
+    ~image_storage();
+
+    image_storage(const image_storage&) = delete;
+    image_storage(image_storage&& other);
+    image_storage& operator = (const image_storage&) = delete;
+    image_storage& operator = (image_storage&& other);
+
+    void* data() const;
+    std::size_t size() const;
+
+private:
+    void release();
+
+private:
+    void* data_ = nullptr;
+    std::size_t size_ = 0;
+
+    /* Set for memory obtained from mmap, and otherwise from operator new */
+    bool mapped_ = false;
+    void* allocation_ = nullptr;
+};
+
+inline void* image_storage::data() const {
+    return data_;
+}
+
+inline std::size_t image_storage::size() const {
+    return size_;
+}
+
+} // apollonian
+
+#endif // IMAGE_STORAGE_HPP
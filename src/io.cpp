@@ -12,6 +12,8 @@
 #include <cairomm/context.h>
 #include <cairomm/surface.h>
 
+#include "png.hpp"
+
 namespace apollonian {
 
 template <typename T>
@@ -19,12 +21,6 @@ inline T clamp(const T& value, const T& min, const T& max) {
     return std::min(max, std::max(min, value));
 }
 
-inline uint8_t
-get_component(int32_t value) {
-    if (value < 0) return 0;
-    return value >> 23;
-}
-
 inline unsigned char*
 write_pixel(const rgb_color& pixel, unsigned char* p) {
     *((uint32_t*)p) = (get_component(pixel.b_) << 0) +
@@ -35,8 +31,14 @@ write_pixel(const rgb_color& pixel, unsigned char* p) {
 }
 
 void save_image(const image_buffer<rgb_color>& image,
-                const std::string& filename)
+                const std::string& filename,
+                png_encoder encoder, int num_threads)
 {
+    if (encoder == png_encoder::parallel) {
+        write_png(image, filename, num_threads);
+        return;
+    }
+
     int rows = image.rows();
     int cols = image.cols();
 
@@ -15,8 +15,18 @@
 
 namespace apollonian {
 
+/* How PNG files are encoded: by cairo, or by write_png, which
+ * compresses on several threads (see png.hpp).
+ */
+enum class png_encoder {
+    cairo,
+    parallel
+};
+
 void save_image(const image_buffer<rgb_color>& image,
-                const std::string& filename);
+                const std::string& filename,
+                png_encoder encoder = png_encoder::cairo,
+                int num_threads = 1);
 
 } // apollonian
 
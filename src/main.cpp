@@ -7,15 +7,33 @@
 
 #include <cmath>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <thread>
 
 #include "filters.hpp"
 #include "io.hpp"
+#include "pyramid.hpp"
 #include "visitor.hpp"
 
 using namespace apollonian;
 
+/* The file name for level k of the pyramid: image.png, image-1.png,
+ * image-2.png, and so on.
+ */
+static std::string level_filename(const std::string& filename, int k) {
+    if (k == 0) return filename;
+    std::string::size_type dot = filename.rfind('.');
+    std::string::size_type slash = filename.rfind('/');
+    if (dot == std::string::npos ||
+        (slash != std::string::npos && dot < slash))
+    {
+        dot = filename.size();
+    }
+    return filename.substr(0, dot) + "-" + std::to_string(k)
+         + filename.substr(dot);
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 2) {
         std::cerr << "usage: " << argv[0]
@@ -36,9 +54,25 @@ int main(int argc, char* argv[]) {
      */
     bool use_filters = true;
 
-    unsharp_mask filter(5.0, 1.0);
+    /* The stages of post-processing, run in order.  For large radii,
+     * blur_method::recursive is much faster, at the cost of faint seams
+     * between filter tiles (see blur_method).
+     */
+    filter_pipeline filters;
+    filters.add(std::make_unique<unsharp_mask>(5.0, 1.0));
 
-    int padding = use_filters? filter.padding() : 0;
+    int padding = use_filters? filters.padding() : 0;
+    int factor = use_filters? filters.factor() : 1;
+
+    /* The built-in encoder compresses on all the threads, and is much
+     * faster than cairo's for large images.
+     */
+    png_encoder encoder = png_encoder::parallel;
+
+    /* Besides the full image, also save this many images, each half
+     * the size of the one before, from the same rendering.
+     */
+    int pyramid_levels = 0;
 
     /* These values can be increased to reduce computation for quicker
      * testing. Set both to 1 for the full rendering.
@@ -46,11 +80,24 @@ int main(int argc, char* argv[]) {
     int scale_down = 1;           /* Increase to make a smaller image. */
     double threshold_factor = 1;  /* Increase to use fewer circles. */
 
-    size_t w = 3840 / scale_down + 2*padding;
-    size_t h = 2160 / scale_down + 2*padding;
-    double res = 1000 / scale_down;
+    size_t w = 3840 / scale_down * factor + 2*padding;
+    size_t h = 2160 / scale_down * factor + 2*padding;
+    double res = 1000 / scale_down * factor;
     rgb_color bgcolor = rgb_color::black;
-    renderer renderer_(w, h, dcomplex(-2.4, -2.0), res);
+
+    /* For images that don't fit in memory, set filename_ to keep the
+     * pixels in a memory-mapped file instead.  huge_pages_ can help
+     * with large images either way.
+     */
+    storage_options storage;
+
+    /* The filtered image is kept the same way, next to it */
+    storage_options filtered_storage = storage;
+    if (!filtered_storage.filename_.empty()) {
+        filtered_storage.filename_ += ".filtered";
+    }
+
+    renderer renderer_(w, h, dcomplex(-2.4, -2.0), res, storage);
     renderer_.fill(bgcolor);
 
     double f = -(2 + std::sqrt(3.0));
@@ -64,16 +111,27 @@ int main(int argc, char* argv[]) {
 
     int num_threads = std::thread::hardware_concurrency();
     int cell_size = 256;
-    rendering_grid grid(num_threads, a, b, c, cell_size, cell_size, visitor);
+
+    /* The top of the tree, down to nodes about the size of a cell, is
+     * only expanded once and shared by all cells.
+     */
+    double frontier_size = cell_size/res;
+    /* Each tile of the output is filtered as soon as the cells under
+     * it are done.
+     */
+    rendering_grid grid(num_threads, a, b, c, cell_size, cell_size,
+                        frontier_size, visitor,
+                        use_filters? &filters : nullptr,
+                        filtered_storage);
     grid.run();
 
-    if (use_filters) {
-        std::cout << "applying post-processing filters..." << std::endl;
-        auto image = filter.apply(visitor.buffer());
-        std::cout << "done." << std::endl;
-        save_image(image, filename);
-    } else {
-        save_image(visitor.buffer(), filename);
+    const image_buffer<rgb_color>& image =
+        use_filters? grid.filtered() : visitor.buffer();
+    auto levels = build_pyramid(image, pyramid_levels, num_threads);
+    save_image(image, filename, encoder, num_threads);
+    for (int k = 1; k <= pyramid_levels; ++k) {
+        save_image(levels[k - 1], level_filename(filename, k),
+                   encoder, num_threads);
     }
 
     return 0;
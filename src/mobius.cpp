@@ -1,16 +0,0 @@
-/* SPDX-License-Identifier: GPL-3.0-only
- *
- * Copyright 2024 Darsh Ranjan.
- *
- * This file is part of super-apollonian-cpp.
- */
-
-#include "mobius.hpp"
-
-namespace apollonian {
-
-const mobius_transformation
-mobius_transformation::identity{1, 0,
-                                0, 1};
-
-} // apollonian
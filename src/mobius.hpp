@@ -8,10 +8,15 @@
 #ifndef MOBIUS_HPP
 #define MOBIUS_HPP
 
+#include <cmath>
+
 #include "riemann_sphere.hpp"
 
 namespace apollonian {
 
+template <typename T>
+class basic_circle;
+
 /* A Mobius transformation is an invertible linear transformation of the
  * projective complex plane.  In non-projective terms, it is a linear
  * fractional transformation, i.e.,
@@ -21,64 +26,101 @@ namespace apollonian {
  * for some a, b, c, and d.  The 2 by 2 matrix representation, which
  * follows immediately from the projective definition, is very
  * convenient.
+ *
+ * T is the real scalar type.  Everything outside of the traversal uses
+ * mobius_transformation, i.e., T = double.
  */
-class mobius_transformation {
+template <typename T>
+class basic_mobius_transformation {
 public:
-    mobius_transformation() = default;
-    mobius_transformation(const dcomplex& v00, const dcomplex& v01,
-                          const dcomplex& v10, const dcomplex& v11);
-    mobius_transformation(
+    using complex = std::complex<T>;
+    using pcomplex = basic_pcomplex<T>;
+
+    basic_mobius_transformation() = default;
+    constexpr basic_mobius_transformation(
+            const complex& v00, const complex& v01,
+            const complex& v10, const complex& v11);
+    basic_mobius_transformation(
             const pcomplex& z0, const pcomplex& z1, const pcomplex& z2,
             const pcomplex& w0, const pcomplex& w1, const pcomplex& w2);
 
-    mobius_transformation inverse() const;
-    mobius_transformation operator * (
-            const mobius_transformation& other) const;
+    /* Conversion from another precision. */
+    template <typename U>
+    explicit basic_mobius_transformation(
+            const basic_mobius_transformation<U>& m);
+
+    basic_mobius_transformation inverse() const;
+    basic_mobius_transformation operator * (
+            const basic_mobius_transformation& other) const;
 
     void normalize();
 
-    static mobius_transformation
+    static basic_mobius_transformation
     cross_ratio(const pcomplex& z0, const pcomplex& z1, const pcomplex& z2);
 
-    static const mobius_transformation identity;
+    static const basic_mobius_transformation identity;
 
-    template <typename T>
-    T operator () (const T& t) const;
+    pcomplex operator () (const pcomplex& z) const;
+    complex operator () (const complex& z) const;
+    basic_circle<T> operator () (const basic_circle<T>& c) const;
 
 public:
-    dcomplex v00_;
-    dcomplex v01_;
-    dcomplex v10_;
-    dcomplex v11_;
+    complex v00_;
+    complex v01_;
+    complex v10_;
+    complex v11_;
 };
 
-inline
-mobius_transformation::mobius_transformation(
-        const dcomplex& v00, const dcomplex& v01,
-        const dcomplex& v10, const dcomplex& v11)
+using mobius_transformation = basic_mobius_transformation<double>;
+
+template <typename T>
+const basic_mobius_transformation<T>
+basic_mobius_transformation<T>::identity{1, 0,
+                                         0, 1};
+
+template <typename T>
+inline constexpr
+basic_mobius_transformation<T>::basic_mobius_transformation(
+        const complex& v00, const complex& v01,
+        const complex& v10, const complex& v11)
     : v00_{v00}, v01_{v01}, v10_{v10}, v11_{v11}
 {
 }
 
+template <typename T>
 inline
-mobius_transformation::mobius_transformation(
+basic_mobius_transformation<T>::basic_mobius_transformation(
         const pcomplex& z0, const pcomplex& z1, const pcomplex& z2,
         const pcomplex& w0, const pcomplex& w1, const pcomplex& w2)
 {
-    mobius_transformation p = cross_ratio(z0, z1, z2);
-    mobius_transformation q = cross_ratio(w0, w1, w2);
+    basic_mobius_transformation p = cross_ratio(z0, z1, z2);
+    basic_mobius_transformation q = cross_ratio(w0, w1, w2);
     *this = q.inverse()*p;
 }
 
-inline mobius_transformation
-mobius_transformation::inverse() const {
+template <typename T>
+template <typename U>
+inline
+basic_mobius_transformation<T>::basic_mobius_transformation(
+        const basic_mobius_transformation<U>& m)
+    : v00_{complex(m.v00_)}, v01_{complex(m.v01_)},
+      v10_{complex(m.v10_)}, v11_{complex(m.v11_)}
+{
+}
+
+template <typename T>
+inline basic_mobius_transformation<T>
+basic_mobius_transformation<T>::inverse() const {
     return { v11_, -v01_,
             -v10_,  v00_};
 }
 
-inline mobius_transformation
-mobius_transformation::operator * (const mobius_transformation& other) const {
-    return mobius_transformation{
+template <typename T>
+inline basic_mobius_transformation<T>
+basic_mobius_transformation<T>::operator * (
+        const basic_mobius_transformation& other) const
+{
+    return basic_mobius_transformation{
         v00_*other.v00_ + v01_*other.v10_,
         v00_*other.v01_ + v01_*other.v11_,
         v10_*other.v00_ + v11_*other.v10_,
@@ -86,50 +128,200 @@ mobius_transformation::operator * (const mobius_transformation& other) const {
     };
 }
 
+template <typename T>
 inline void
-mobius_transformation::normalize() {
-    dcomplex f = std::sqrt(v00_*v11_ - v01_*v10_);
+basic_mobius_transformation<T>::normalize() {
+    complex f = std::sqrt(v00_*v11_ - v01_*v10_);
     v00_ *= f;
     v01_ *= f;
     v10_ *= f;
     v11_ *= f;
 }
 
-inline mobius_transformation
-mobius_transformation::cross_ratio(
+template <typename T>
+inline basic_mobius_transformation<T>
+basic_mobius_transformation<T>::cross_ratio(
         const pcomplex& z0, const pcomplex& z1, const pcomplex& z2)
 {
-    const dcomplex& a0(z0.v0_);
-    const dcomplex& a1(z1.v0_);
-    const dcomplex& a2(z2.v0_);
+    const complex& a0(z0.v0_);
+    const complex& a1(z1.v0_);
+    const complex& a2(z2.v0_);
 
-    const dcomplex& b0(z0.v1_);
-    const dcomplex& b1(z1.v1_);
-    const dcomplex& b2(z2.v1_);
+    const complex& b0(z0.v1_);
+    const complex& b1(z1.v1_);
+    const complex& b2(z2.v1_);
 
-    dcomplex det02 = a0*b2 - a2*b0;
-    dcomplex det21 = a2*b1 - a1*b2;
-    dcomplex det10 = a1*b0 - a0*b1;
+    complex det02 = a0*b2 - a2*b0;
+    complex det21 = a2*b1 - a1*b2;
+    complex det10 = a1*b0 - a0*b1;
 
-    dcomplex f = 1.0/std::sqrt(det02*det21*det10);
-    dcomplex num = det02*f;
-    dcomplex den = det21*f;
+    complex f = T(1)/std::sqrt(det02*det21*det10);
+    complex num = det02*f;
+    complex den = det21*f;
 
     return { b1*num, -a1*num,
             -b0*den,  a0*den};
 }
 
-template <>
-inline pcomplex
-mobius_transformation::operator () (const pcomplex& t) const {
-    return {v00_*t.v0_ + v01_*t.v1_,
-            v10_*t.v0_ + v11_*t.v1_};
+template <typename T>
+inline basic_pcomplex<T>
+basic_mobius_transformation<T>::operator () (const pcomplex& z) const {
+    return {v00_*z.v0_ + v01_*z.v1_,
+            v10_*z.v0_ + v11_*z.v1_};
+}
+
+template <typename T>
+inline std::complex<T>
+basic_mobius_transformation<T>::operator () (const complex& z) const {
+    return operator () (pcomplex(z));
 }
 
+/* Multiplication by an integer K, or by a Gaussian integer A + B*i,
+ * known at compile time.  Only the real operations that are actually
+ * needed are done, so multiplying by 0, 1, -1, i, or -i costs nothing.
+ */
+template <int K>
+struct integer_constant {
+    template <typename T>
+    static T times(const T& x) { return T(K)*x; }
+};
+
 template <>
-inline dcomplex
-mobius_transformation::operator () (const dcomplex& t) const {
-    return operator () (pcomplex(t));
+struct integer_constant<1> {
+    template <typename T>
+    static T times(const T& x) { return x; }
+};
+
+template <>
+struct integer_constant<-1> {
+    template <typename T>
+    static T times(const T& x) { return -x; }
+};
+
+template <int A, int B>
+struct gaussian_constant {
+    template <typename T>
+    static std::complex<T> times(const std::complex<T>& z) {
+        return {integer_constant<A>::times(z.real())
+                    - integer_constant<B>::times(z.imag()),
+                integer_constant<A>::times(z.imag())
+                    + integer_constant<B>::times(z.real())};
+    }
+};
+
+template <int A>
+struct gaussian_constant<A, 0> {
+    template <typename T>
+    static std::complex<T> times(const std::complex<T>& z) {
+        return {integer_constant<A>::times(z.real()),
+                integer_constant<A>::times(z.imag())};
+    }
+};
+
+template <int B>
+struct gaussian_constant<0, B> {
+    template <typename T>
+    static std::complex<T> times(const std::complex<T>& z) {
+        return {integer_constant<-B>::times(z.imag()),
+                integer_constant<B>::times(z.real())};
+    }
+};
+
+/* z0*(A0 + B0*i) + z1*(A1 + B1*i), leaving out zero terms. */
+template <int A0, int B0, int A1, int B1>
+struct gaussian_dot {
+    template <typename T>
+    static std::complex<T> apply(const std::complex<T>& z0,
+                                 const std::complex<T>& z1)
+    {
+        return gaussian_constant<A0, B0>::times(z0)
+            + gaussian_constant<A1, B1>::times(z1);
+    }
+};
+
+template <int A0, int B0>
+struct gaussian_dot<A0, B0, 0, 0> {
+    template <typename T>
+    static std::complex<T> apply(const std::complex<T>& z0,
+                                 const std::complex<T>&)
+    {
+        return gaussian_constant<A0, B0>::times(z0);
+    }
+};
+
+template <int A1, int B1>
+struct gaussian_dot<0, 0, A1, B1> {
+    template <typename T>
+    static std::complex<T> apply(const std::complex<T>&,
+                                 const std::complex<T>& z1)
+    {
+        return gaussian_constant<A1, B1>::times(z1);
+    }
+};
+
+/* Scaling by 1/sqrt(N). */
+template <unsigned int N>
+struct inverse_root {
+    template <typename T>
+    static void scale(basic_mobius_transformation<T>& m) {
+        const T f = 1/std::sqrt(T(N));
+        m.v00_ *= f;
+        m.v01_ *= f;
+        m.v10_ *= f;
+        m.v11_ *= f;
+    }
+};
+
+template <>
+struct inverse_root<1> {
+    template <typename T>
+    static void scale(basic_mobius_transformation<T>&) {}
+};
+
+/* A Mobius transformation known at compile time, of the form G/sqrt(N)
+ * for a matrix G of Gaussian integers with determinant N, so that the
+ * whole matrix has determinant 1.  Composing with it folds all of the
+ * constants into the arithmetic.
+ */
+template <int A00, int B00, int A01, int B01,
+          int A10, int B10, int A11, int B11,
+          unsigned int N = 1>
+struct static_mobius_transformation {
+    static mobius_transformation value();
+
+    /* Same as m*value(), in the precision of m. */
+    template <typename T>
+    static basic_mobius_transformation<T> right_multiply(
+            const basic_mobius_transformation<T>& m);
+};
+
+template <int A00, int B00, int A01, int B01,
+          int A10, int B10, int A11, int B11,
+          unsigned int N>
+inline mobius_transformation
+static_mobius_transformation<A00, B00, A01, B01,
+                             A10, B10, A11, B11, N>::value()
+{
+    return right_multiply(mobius_transformation::identity);
+}
+
+template <int A00, int B00, int A01, int B01,
+          int A10, int B10, int A11, int B11,
+          unsigned int N>
+template <typename T>
+inline basic_mobius_transformation<T>
+static_mobius_transformation<A00, B00, A01, B01,
+                             A10, B10, A11, B11, N>::right_multiply(
+        const basic_mobius_transformation<T>& m)
+{
+    basic_mobius_transformation<T> result{
+        gaussian_dot<A00, B00, A10, B10>::apply(m.v00_, m.v01_),
+        gaussian_dot<A01, B01, A11, B11>::apply(m.v00_, m.v01_),
+        gaussian_dot<A00, B00, A10, B10>::apply(m.v10_, m.v11_),
+        gaussian_dot<A01, B01, A11, B11>::apply(m.v10_, m.v11_),
+    };
+    inverse_root<N>::scale(result);
+    return result;
 }
 
 } // apollonian
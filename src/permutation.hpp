@@ -35,7 +35,11 @@ public:
     static const permutation<N> identity;
 
 public:
-    std::array<unsigned int, N> v_;
+    /* Permutations are stored in every traversal state, so the indices
+     * are kept as small as possible.
+     */
+    static_assert(N <= 256, "permutation indices must fit in a byte");
+    std::array<unsigned char, N> v_;
 };
 
 template <unsigned int N>
@@ -48,7 +52,7 @@ permutation<N>::permutation() {
 template <unsigned int N>
 template <typename... T>
 permutation<N>::permutation(T... args)
-    : v_{(unsigned int)(args)...}
+    : v_{(unsigned char)(args)...}
 {
 }
 
@@ -97,6 +101,28 @@ template <unsigned int N>
 const permutation<N>
 permutation<N>::identity;
 
+/* A permutation known at compile time. */
+template <unsigned int... P>
+struct static_permutation {
+    static permutation<sizeof...(P)> value();
+
+    /* Same as value()*q, fully unrolled. */
+    static permutation<sizeof...(P)> left_multiply(
+            const permutation<sizeof...(P)>& q);
+};
+
+template <unsigned int... P>
+inline permutation<sizeof...(P)>
+static_permutation<P...>::value() {
+    return {P...};
+}
+
+template <unsigned int... P>
+inline permutation<sizeof...(P)>
+static_permutation<P...>::left_multiply(const permutation<sizeof...(P)>& q) {
+    return {q.v_[P]...};
+}
+
 } // apollonian
 
 #endif // PERMUTATION_HPP
@@ -0,0 +1,140 @@
+/* SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Copyright 2024 Darsh Ranjan.
+ *
+ * This file is part of super-apollonian-cpp.
+ */
+
+/* Planar storage for color images.
+ *
+ * The renderer works on interleaved rgb_color pixels, since every
+ * drawing operation updates all three channels of a pixel together.
+ * The filters, on the other hand, work on one channel at a time, and
+ * are much easier to vectorize when consecutive values in memory
+ * belong to the same channel.  A planar_image keeps each channel in
+ * its own image_buffer, each with aligned and padded rows.  A
+ * filter_pipeline converts the rendered image to planar doubles and
+ * back one tile at a time (see split_channels and merge_channels), so
+ * there is never a planar copy of the whole image.
+ */
+#ifndef PLANAR_IMAGE_HPP
+#define PLANAR_IMAGE_HPP
+
+#include <array>
+#include <utility>
+
+#include "color.hpp"
+#include "image_buffer.hpp"
+
+namespace apollonian {
+
+template <typename T>
+class planar_image {
+public:
+    planar_image(int rows, int cols);
+    planar_image(image_buffer<T>&& r, image_buffer<T>&& g,
+                 image_buffer<T>&& b);
+
+    const image_buffer<T>& channel(int k) const;
+    image_buffer<T>& channel(int k);
+
+    int rows() const;
+    int cols() const;
+
+public:
+    static constexpr int num_channels = 3;
+
+private:
+    std::array<image_buffer<T>, num_channels> channels_;
+};
+
+/* Channels as doubles in [0, 1] (for a valid image) */
+planar_image<double> split_channels(image_view<const rgb_color> image);
+
+/* The pixel of a planar image, with the channels clamped to [0, 1] */
+rgb_color get_pixel(const planar_image<double>& image, int row, int col);
+
+/* Back to rgb_color, into the top left corner of dst */
+void merge_channels(const planar_image<double>& image,
+                    image_view<rgb_color> dst);
+
+template <typename T>
+planar_image<T>::planar_image(int rows, int cols)
+    : channels_{{{rows, cols}, {rows, cols}, {rows, cols}}}
+{
+}
+
+template <typename T>
+planar_image<T>::planar_image(image_buffer<T>&& r, image_buffer<T>&& g,
+                              image_buffer<T>&& b)
+    : channels_{{std::move(r), std::move(g), std::move(b)}}
+{
+}
+
+template <typename T>
+const image_buffer<T>& planar_image<T>::channel(int k) const {
+    return channels_[k];
+}
+
+template <typename T>
+image_buffer<T>& planar_image<T>::channel(int k) {
+    return channels_[k];
+}
+
+template <typename T>
+int planar_image<T>::rows() const {
+    return channels_[0].rows();
+}
+
+template <typename T>
+int planar_image<T>::cols() const {
+    return channels_[0].cols();
+}
+
+inline planar_image<double>
+split_channels(image_view<const rgb_color> image) {
+    int rows = image.rows();
+    int cols = image.cols();
+    planar_image<double> channels(rows, cols);
+    for (int row = 0; row < rows; ++row) {
+        const rgb_color* src = image[row];
+        double* r = channels.channel(0)[row];
+        double* g = channels.channel(1)[row];
+        double* b = channels.channel(2)[row];
+        for (int col = 0; col < cols; ++col) {
+            r[col] = double(src[col].r_) / 0x7fffffff;
+            g[col] = double(src[col].g_) / 0x7fffffff;
+            b[col] = double(src[col].b_) / 0x7fffffff;
+        }
+    }
+    return channels;
+}
+
+inline double normalize_channel(double x) {
+    if (x < 0) x = 0;
+    if (x > 1) x = 1;
+    return x;
+}
+
+inline rgb_color
+get_pixel(const planar_image<double>& image, int row, int col) {
+    return rgb_color(normalize_channel(image.channel(0)(row, col)),
+                     normalize_channel(image.channel(1)(row, col)),
+                     normalize_channel(image.channel(2)(row, col)));
+}
+
+inline void
+merge_channels(const planar_image<double>& image, image_view<rgb_color> dst) {
+    int rows = image.rows();
+    int cols = image.cols();
+    for (int row = 0; row < rows; ++row) {
+        rgb_color* p = dst[row];
+        for (int col = 0; col < cols; ++col) {
+            p[col] = get_pixel(image, row, col);
+        }
+    }
+}
+
+} // apollonian
+
+#endif // PLANAR_IMAGE_HPP
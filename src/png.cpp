@@ -0,0 +1,294 @@
+/* SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Copyright 2024 Darsh Ranjan.
+ *
+ * This file is part of super-apollonian-cpp.
+ */
+
+#include "png.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+#include <zlib.h>
+
+#include "concurrency.hpp"
+
+namespace apollonian {
+
+namespace {
+
+/* Uncompressed bytes in each group of rows.  Smaller groups spread
+ * better over threads, while each group costs a sync flush and a
+ * chunk header, and repeats the filtering of the rows under its
+ * dictionary.
+ */
+constexpr std::size_t group_size = 1 << 18;
+
+/* The largest dictionary deflate can use */
+constexpr std::size_t window_size = 1 << 15;
+
+/* Exceptions can't leave the compression threads, so they are caught
+ * there, kept in error_, and rethrown once the threads are done.
+ */
+struct compressed_group {
+public:
+    std::vector<unsigned char> data_;
+    uLong adler_ = 0;
+    std::size_t size_ = 0;
+    std::exception_ptr error_;
+};
+
+[[noreturn]] void throw_errno(const std::string& what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+/* Row k of the PNG, as RGB bytes */
+void get_row(image_view<const rgb_color> image, int k, unsigned char* dst) {
+    const rgb_color* src = image[image.rows() - k - 1];
+    for (int col = 0; col < image.cols(); ++col) {
+        dst[3*col + 0] = get_component(src[col].r_);
+        dst[3*col + 1] = get_component(src[col].g_);
+        dst[3*col + 2] = get_component(src[col].b_);
+    }
+}
+
+unsigned char paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+/* Apply filter type to a row of n bytes, given the row before it, and
+ * return the sum of the absolute (signed) values of the result.
+ */
+template <int type>
+long filter_with(const unsigned char* row, const unsigned char* prev,
+                 std::size_t n, unsigned char* dst)
+{
+    constexpr std::size_t bpp = 3;
+    long cost = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        int a = i >= bpp ? row[i - bpp] : 0;
+        int b = prev[i];
+        int c = i >= bpp ? prev[i - bpp] : 0;
+        int predictor = 0;
+        if (type == 1) predictor = a;
+        if (type == 2) predictor = b;
+        if (type == 3) predictor = (a + b)/2;
+        if (type == 4) predictor = paeth(a, b, c);
+        unsigned char v = row[i] - predictor;
+        dst[i] = v;
+        cost += v < 128 ? v : 256 - v;
+    }
+    return cost;
+}
+
+/* Filter a row of n bytes, given the row before it, into dst, which
+ * starts with the filter type.  Each filter is tried, and the one with
+ * the smallest sum of absolute values is kept, which is the heuristic
+ * the PNG specification suggests.  candidate is scratch space of n
+ * bytes.
+ */
+void filter_row(const unsigned char* row, const unsigned char* prev,
+                std::size_t n, unsigned char* dst,
+                unsigned char* candidate)
+{
+    using filter = long (*)(const unsigned char*, const unsigned char*,
+                            std::size_t, unsigned char*);
+    static constexpr filter filters[] = {
+        filter_with<0>, filter_with<1>, filter_with<2>,
+        filter_with<3>, filter_with<4>
+    };
+
+    long best_cost = -1;
+    for (int type = 0; type < 5; ++type) {
+        long cost = filters[type](row, prev, n, candidate);
+        if (best_cost < 0 || cost < best_cost) {
+            best_cost = cost;
+            dst[0] = type;
+            std::copy(candidate, candidate + n, dst + 1);
+        }
+    }
+}
+
+/* The rows [row_begin, row_end) of the PNG, filtered, each taking
+ * one byte more than its pixels.
+ */
+std::vector<unsigned char>
+filter_rows(image_view<const rgb_color> image, int row_begin, int row_end) {
+    std::size_t n = 3*std::size_t(image.cols());
+    std::vector<unsigned char> result((n + 1)*(row_end - row_begin));
+    std::vector<unsigned char> prev(n);
+    std::vector<unsigned char> row(n);
+    std::vector<unsigned char> candidate(n);
+    if (row_begin > 0) get_row(image, row_begin - 1, prev.data());
+    for (int k = row_begin; k < row_end; ++k) {
+        get_row(image, k, row.data());
+        filter_row(row.data(), prev.data(), n,
+                   &result[(n + 1)*(k - row_begin)], candidate.data());
+        std::swap(row, prev);
+    }
+    return result;
+}
+
+compressed_group
+compress_rows(image_view<const rgb_color> image, int row_begin, int row_end,
+              int dict_begin, bool last)
+{
+    std::vector<unsigned char> raw = filter_rows(image, dict_begin, row_end);
+    std::size_t stride = 3*std::size_t(image.cols()) + 1;
+    std::size_t start = stride*(row_begin - dict_begin);
+
+    compressed_group result;
+    result.size_ = raw.size() - start;
+    result.adler_ = adler32(adler32(0, nullptr, 0),
+                            raw.data() + start, result.size_);
+
+    /* The same settings as libpng, which cairo uses */
+    z_stream z{};
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                     Z_FILTERED) != Z_OK)
+    {
+        throw std::runtime_error("deflateInit2 failed");
+    }
+    std::size_t dict_size = std::min(start, window_size);
+    if (dict_size > 0) {
+        deflateSetDictionary(&z, raw.data() + start - dict_size, dict_size);
+    }
+
+    /* deflateBound doesn't count the empty block of a sync flush. */
+    try {
+        result.data_.resize(deflateBound(&z, result.size_) + 16);
+    } catch (...) {
+        deflateEnd(&z);
+        throw;
+    }
+    z.next_in = raw.data() + start;
+    z.avail_in = result.size_;
+    z.next_out = result.data_.data();
+    z.avail_out = result.data_.size();
+    int status = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+    bool ok = last ? status == Z_STREAM_END :
+                     status == Z_OK && z.avail_in == 0 && z.avail_out > 0;
+    result.data_.resize(z.total_out);
+    deflateEnd(&z);
+    if (!ok) throw std::runtime_error("deflate failed");
+    return result;
+}
+
+void put_u32(std::vector<unsigned char>& out, uint32_t value) {
+    out.push_back(value >> 24);
+    out.push_back(value >> 16);
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+void write_bytes(std::FILE* file, const unsigned char* data, std::size_t size,
+                 const std::string& filename)
+{
+    if (size > 0 && std::fwrite(data, 1, size, file) != size) {
+        int error = errno;
+        std::fclose(file);
+        errno = error;
+        throw_errno("write " + filename);
+    }
+}
+
+void write_chunk(std::FILE* file, const char* type,
+                 const std::vector<unsigned char>& data,
+                 const std::string& filename)
+{
+    std::vector<unsigned char> header;
+    put_u32(header, data.size());
+    header.insert(header.end(), type, type + 4);
+    /* crc32 restarts when given a null pointer, as for an empty vector */
+    uLong crc = crc32(crc32(0, nullptr, 0), header.data() + 4, 4);
+    if (!data.empty()) crc = crc32(crc, data.data(), data.size());
+    std::vector<unsigned char> trailer;
+    put_u32(trailer, crc);
+
+    write_bytes(file, header.data(), header.size(), filename);
+    write_bytes(file, data.data(), data.size(), filename);
+    write_bytes(file, trailer.data(), trailer.size(), filename);
+}
+
+} // namespace
+
+void write_png(image_view<const rgb_color> image, const std::string& filename,
+               int num_threads)
+{
+    /* PNG has no empty images. */
+    if (image.rows() <= 0 || image.cols() <= 0) {
+        throw std::invalid_argument("write_png: empty image");
+    }
+
+    int rows = image.rows();
+    std::size_t stride = 3*std::size_t(image.cols()) + 1;
+    int group_rows = std::max<std::size_t>(1, group_size/stride);
+    int dict_rows = (window_size + stride - 1)/stride;
+    int num_groups = (rows + group_rows - 1)/group_rows;
+
+    std::vector<compressed_group> groups(num_groups);
+    parallel_blocks(num_threads, num_groups, 1, [&](int begin, int end) {
+        for (int k = begin; k < end; ++k) {
+            int row_begin = k*group_rows;
+            int row_end = std::min(rows, row_begin + group_rows);
+            try {
+                groups[k] = compress_rows(image, row_begin, row_end,
+                                          std::max(0, row_begin - dict_rows),
+                                          k == num_groups - 1);
+            } catch (...) {
+                groups[k].error_ = std::current_exception();
+            }
+        }
+    });
+    for (const compressed_group& group : groups) {
+        if (group.error_) std::rethrow_exception(group.error_);
+    }
+
+    std::FILE* file = std::fopen(filename.c_str(), "wb");
+    if (!file) throw_errno("open " + filename);
+
+    static const unsigned char signature[] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+    };
+    write_bytes(file, signature, sizeof(signature), filename);
+
+    /* 8 bits per channel, RGB, no interlacing */
+    std::vector<unsigned char> header;
+    put_u32(header, image.cols());
+    put_u32(header, rows);
+    header.insert(header.end(), {8, 2, 0, 0, 0});
+    write_chunk(file, "IHDR", header, filename);
+
+    /* The zlib header for deflate with a 32 KiB window, at the default
+     * level, goes in front of the first group, and the checksum of all
+     * the data after the last.
+     */
+    uLong adler = adler32(0, nullptr, 0);
+    for (int k = 0; k < num_groups; ++k) {
+        std::vector<unsigned char>& data = groups[k].data_;
+        if (k == 0) data.insert(data.begin(), {0x78, 0x9c});
+        adler = adler32_combine(adler, groups[k].adler_, groups[k].size_);
+        if (k == num_groups - 1) put_u32(data, adler);
+        write_chunk(file, "IDAT", data, filename);
+        std::vector<unsigned char>().swap(data);
+    }
+    write_chunk(file, "IEND", {}, filename);
+
+    if (std::fclose(file) != 0) throw_errno("close " + filename);
+}
+
+} // apollonian
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Copyright 2024 Darsh Ranjan.
+ *
+ * This file is part of super-apollonian-cpp.
+ */
+
+/* A PNG encoder that compresses in parallel.
+ *
+ * The image is split into groups of rows, which are filtered and
+ * deflated independently on separate threads, the way pigz does it:
+ * each group is primed with the 32 KiB of data before it as its
+ * dictionary, and ends on a byte boundary with a sync flush, so the
+ * compressed groups can simply be concatenated into a single zlib
+ * stream.  The checksums of the groups are combined with
+ * adler32_combine.  The groups are then written in order, one IDAT
+ * chunk each.
+ */
+#ifndef PNG_HPP
+#define PNG_HPP
+
+#include <string>
+
+#include "color.hpp"
+#include "image_buffer.hpp"
+
+namespace apollonian {
+
+/* Write an 8-bit RGB PNG file, with the first row of the image at the
+ * bottom, as save_image does.  Errors are reported by throwing
+ * std::system_error for the file, std::runtime_error for zlib, and
+ * std::invalid_argument for an empty image, which PNG can't represent.
+ */
+void write_png(image_view<const rgb_color> image, const std::string& filename,
+               int num_threads);
+
+} // apollonian
+
+#endif // PNG_HPP
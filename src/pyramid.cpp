@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Copyright 2024 Darsh Ranjan.
+ *
+ * This file is part of super-apollonian-cpp.
+ */
+
+#include "pyramid.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+#include "concurrency.hpp"
+
+namespace apollonian {
+
+namespace {
+
+/* Smallest side of a block of the full image.  Blocks are also big
+ * enough to be halved num_levels times without rounding, so that the
+ * blocks of each level only depend on the same blocks of the level
+ * before.
+ */
+constexpr int min_block_size = 256;
+
+/* Halve the rows [row_begin, row_end) and columns [col_begin, col_end)
+ * of dst, from src, which is twice the size (rounded up).
+ */
+void halve(image_view<const rgb_color> src, image_view<rgb_color> dst,
+           int row_begin, int row_end, int col_begin, int col_end)
+{
+    for (int row = row_begin; row < row_end; ++row) {
+        const rgb_color* s0 = src[2*row];
+        const rgb_color* s1 = 2*row + 1 < src.rows() ? src[2*row + 1] : s0;
+        rgb_color* d = dst[row];
+        for (int col = col_begin; col < col_end; ++col) {
+            int c0 = 2*col;
+            int c1 = 2*col + 1 < src.cols() ? 2*col + 1 : c0;
+
+            /* Pixels past the edge are stand-ins for the ones before
+             * them, so duplicates count twice, which keeps the weights
+             * even.
+             */
+            int64_t r = int64_t(s0[c0].r_) + s0[c1].r_
+                      + s1[c0].r_ + s1[c1].r_;
+            int64_t g = int64_t(s0[c0].g_) + s0[c1].g_
+                      + s1[c0].g_ + s1[c1].g_;
+            int64_t b = int64_t(s0[c0].b_) + s0[c1].b_
+                      + s1[c0].b_ + s1[c1].b_;
+
+            rgb_color p{};
+            p.r_ = int32_t(r/4);
+            p.g_ = int32_t(g/4);
+            p.b_ = int32_t(b/4);
+            d[col] = p;
+        }
+    }
+}
+
+} // namespace
+
+std::vector<image_buffer<rgb_color>>
+build_pyramid(image_view<const rgb_color> image, int num_levels,
+              int num_threads)
+{
+    std::vector<image_buffer<rgb_color>> levels;
+    int rows = image.rows();
+    int cols = image.cols();
+    for (int k = 0; k < num_levels; ++k) {
+        rows = (rows + 1)/2;
+        cols = (cols + 1)/2;
+        levels.emplace_back(rows, cols);
+    }
+    if (num_levels == 0) return levels;
+
+    int block = std::max(min_block_size, 1 << num_levels);
+    int block_rows = (image.rows() + block - 1)/block;
+    int block_cols = (image.cols() + block - 1)/block;
+    parallel_blocks(num_threads, block_rows*block_cols, 1,
+                    [&](int begin, int end) {
+        for (int t = begin; t < end; ++t) {
+            int row0 = (t/block_cols)*block;
+            int col0 = (t % block_cols)*block;
+            int row1 = row0 + block;
+            int col1 = col0 + block;
+            image_view<const rgb_color> src = image;
+            for (auto& level : levels) {
+                row0 /= 2;
+                col0 /= 2;
+                row1 /= 2;
+                col1 /= 2;
+                halve(src, level,
+                      row0, std::min(level.rows(), row1),
+                      col0, std::min(level.cols(), col1));
+                src = level;
+            }
+        }
+    });
+    return levels;
+}
+
+} // apollonian
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Copyright 2024 Darsh Ranjan.
+ *
+ * This file is part of super-apollonian-cpp.
+ */
+
+/* Mip pyramids: successively halved copies of an image, so that one
+ * rendering gives every output size at once.
+ */
+#ifndef PYRAMID_HPP
+#define PYRAMID_HPP
+
+#include <vector>
+
+#include "color.hpp"
+#include "image_buffer.hpp"
+
+namespace apollonian {
+
+/* Levels 1 to num_levels of the pyramid over image, which is level 0.
+ * Each level is half the size of the one before, rounded up, and each
+ * of its pixels is the average of the (up to) 2x2 pixels under it.
+ *
+ * All the levels are computed in one pass over the image, a block at a
+ * time: each block is halved repeatedly while it is still in cache.
+ * The blocks are spread over num_threads threads.
+ */
+std::vector<image_buffer<rgb_color>>
+build_pyramid(image_view<const rgb_color> image, int num_levels,
+              int num_threads);
+
+} // apollonian
+
+#endif // PYRAMID_HPP
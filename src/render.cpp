@@ -11,40 +11,77 @@
 
 namespace apollonian {
 
-renderer::renderer(double x0, double y0, int w, int h, double res)
-    : x0_{x0}, y0_{y0}, image_{h, w}, res_{res}
+renderer::renderer(double x0, double y0, int w, int h, double res,
+                   const storage_options& options)
+    : x0_{x0}, y0_{y0}, buffer_{h, w, options}, res_{res},
+      mode_{fill_mode::replace}
 {
+    image_ = buffer_;
     dcomplex z1 = unmap(image_.cols(), image_.rows());
     bbox_ = {x0_, z1.real(), y0_, z1.imag()};
 }
 
 renderer::renderer(
-        int w, int h, const dcomplex& center, double res)
-    : renderer{center.real() - 0.5*w/res, center.imag() - 0.5*h/res, w, h, res}
+        int w, int h, const dcomplex& center, double res,
+        const storage_options& options)
+    : renderer{center.real() - 0.5*w/res, center.imag() - 0.5*h/res, w, h, res,
+               options}
 {
 }
 
-renderer renderer::window(int col0, int row0, int cols, int rows) const {
+renderer::renderer(double x0, double y0, image_view<rgb_color> image,
+                   double res)
+    : x0_{x0}, y0_{y0}, buffer_{0, 0}, image_{image}, res_{res},
+      mode_{fill_mode::replace}
+{
+    dcomplex z1 = unmap(image_.cols(), image_.rows());
+    bbox_ = {x0_, z1.real(), y0_, z1.imag()};
+}
+
+renderer renderer::window(int col0, int row0, int cols, int rows) {
+    dcomplex z0 = unmap(col0, row0);
+    return {z0.real(), z0.imag(), image_.window(col0, row0, cols, rows),
+            res_};
+}
+
+renderer renderer::accumulator(int col0, int row0, int cols, int rows) const {
     if (col0 + cols > image_.cols()) cols = image_.cols() - col0;
     if (row0 + rows > image_.rows()) rows = image_.rows() - row0;
     dcomplex z0 = unmap(col0, row0);
     renderer window_renderer{z0.real(), z0.imag(), cols, rows, res_};
-    for (int row = 0; row < rows; ++row) {
-        const rgb_color* src = image_[row0 + row] + col0;
-        rgb_color* dst = window_renderer.image_[row];
-        std::copy(src, src + cols, dst);
-    }
+    window_renderer.fill(rgb_color{0.0, 0.0, 0.0});
+    window_renderer.mode_ = fill_mode::add;
     return window_renderer;
 }
 
-void renderer::set_window(int col0, int row0, const renderer& window) {
+void renderer::add_window(int col0, int row0, const renderer& window) {
     int rows = window.image_.rows();
     int cols = window.image_.cols();
     for (int row = 0; row < rows; ++row) {
         const rgb_color* src = window.image_[row];
         rgb_color* dst = image_[row0 + row] + col0;
-        std::copy(src, src + cols, dst);
+        for (int col = 0; col < cols; ++col) {
+            dst[col] += src[col];
+        }
+    }
+}
+
+void renderer::add_window(int col0, int row0,
+                          const tiled_image<rgb_color>& window)
+{
+    window.add_to(image_.window(col0, row0, window.cols(), window.rows()));
+}
+
+void renderer::set_fill_mode(fill_mode mode) {
+    flush();
+    if (mode_ != fill_mode::difference && mode == fill_mode::difference) {
+        to_differences(image_);
+    } else if (mode_ == fill_mode::difference &&
+               mode != fill_mode::difference)
+    {
+        from_differences(image_);
     }
+    mode_ = mode;
 }
 
 } // apollonian
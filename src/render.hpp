@@ -9,6 +9,7 @@
 #define RENDER_HPP
 
 #include <cmath>
+#include <vector>
 
 #include "riemann_sphere.hpp"
 #include "color.hpp"
@@ -16,31 +17,78 @@
 #include "box.hpp"
 #include "image_buffer.hpp"
 #include "graphics.hpp"
+#include "tiled_image.hpp"
 
 namespace apollonian {
 
+/* Disks queued by render_circle before they are drawn together by
+ * draw_circles.  A few thousand disks of the sizes found deep in the
+ * traversal cover a cell many times over, which is what makes the
+ * banding worthwhile.
+ */
+constexpr std::size_t max_queued_circles = 4096;
+
 class renderer {
 public:
-    renderer(double x0, double y0, int w, int h, double res);
-    renderer(int w, int h, const dcomplex& center, double res);
+    renderer(double x0, double y0, int w, int h, double res,
+             const storage_options& options = {});
+    renderer(int w, int h, const dcomplex& center, double res,
+             const storage_options& options = {});
+
+    /* A renderer drawing into pixels it doesn't own */
+    renderer(double x0, double y0, image_view<rgb_color> image, double res);
+
+    /* A copy would still draw into the original's image_buffer. */
+    renderer(const renderer&) = delete;
+    renderer(renderer&&) = default;
+    renderer& operator = (const renderer&) = delete;
+    renderer& operator = (renderer&&) = default;
 
 public:
+    /* Disks are only queued, to be drawn in one batch by flush(), which
+     * happens when the queue is full, before anything else is drawn,
+     * and before the image is used in any other way.  Since disks are
+     * drawn in order within each pixel, this is invisible except for
+     * the image_ member, which is only up to date after flush().
+     */
     void render_circle(const circle& circle, const rgb_color& new_color,
                        const rgb_color& old_color);
+    void flush();
     void fill(const rgb_color& color);
     void map(const dcomplex& z, double& col, double& row) const;
     dcomplex unmap(double col, double row) const;
     intersection_type intersects_circle(const circle& c) const;
 
-    renderer window(int col0, int row0, int cols, int rows) const;
-    void set_window(int col0, int row0, const renderer& window);
+    /* A renderer drawing directly into part of this one's image, with
+     * no copying.  The window must be flushed (see render_circle)
+     * before this image is used again.  Windows that don't overlap can
+     * be drawn into from different threads.
+     */
+    renderer window(int col0, int row0, int cols, int rows);
+
+    /* A blank window that only accumulates the changes made by
+     * drawing, to be merged back with add_window.
+     */
+    renderer accumulator(int col0, int row0, int cols, int rows) const;
+    void add_window(int col0, int row0, const renderer& window);
+    void add_window(int col0, int row0, const tiled_image<rgb_color>& window);
+
+    /* Switch to another fill mode, converting the image to or from the
+     * difference representation of fill_mode::difference as needed.
+     */
+    void set_fill_mode(fill_mode mode);
 
 public:
     double x0_;
     double y0_;
     box bbox_;
-    image_buffer<rgb_color> image_;
+
+    /* The pixels of image_, for a renderer that owns them */
+    image_buffer<rgb_color> buffer_;
+    image_view<rgb_color> image_;
     double res_;
+    fill_mode mode_;
+    std::vector<circle_draw> queue_;
 };
 
 inline intersection_type
@@ -57,22 +105,34 @@ renderer::render_circle(const circle& circle, const rgb_color& new_color,
         double b = 2*circle.v01_.imag()/res_;
         double c = circle.v11_ + 2*(circle.v01_.real()*x0_
                                   + circle.v01_.imag()*y0_);
-        draw_half_plane(image_, a, b, c, new_color, old_color);
+        flush();
+        draw_half_plane(image_, a, b, c, new_color, old_color, mode_);
     } else {
         double xc;
         double yc;
         map(circle.center(), xc, yc);
         double r = circle.radius()*res_;
         if (r < 0) {
-            draw_circle_complement(image_, xc, yc, -r, new_color, old_color);
+            flush();
+            draw_circle_complement(image_, xc, yc, -r,
+                                   new_color, old_color, mode_);
         } else {
-            draw_circle(image_, xc, yc, r, new_color, old_color);
+            queue_.push_back({xc, yc, r, new_color, old_color});
+            if (queue_.size() >= max_queued_circles) flush();
         }
     }
 }
 
+inline void
+renderer::flush() {
+    if (queue_.empty()) return;
+    draw_circles(image_, queue_, mode_);
+    queue_.clear();
+}
+
 inline void
 renderer::fill(const rgb_color& color) {
+    queue_.clear();
     image_.fill(color);
 }
 
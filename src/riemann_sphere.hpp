@@ -13,33 +13,46 @@
 namespace apollonian {
 
 using dcomplex = std::complex<double>;
+using fcomplex = std::complex<float>;
 
 using namespace std::complex_literals;
 
-/* Projective complex number */
-class pcomplex {
+/* Projective complex number, with components of type std::complex<T>.
+ */
+template <typename T>
+class basic_pcomplex {
 public:
-    pcomplex() = default;
-    pcomplex(const dcomplex& numerator,
-             const dcomplex& denominator);
-    pcomplex(const dcomplex& value);
+    using complex = std::complex<T>;
+
+    basic_pcomplex() = default;
+    basic_pcomplex(const complex& numerator,
+                   const complex& denominator);
+    basic_pcomplex(const complex& value);
 
-    operator dcomplex() const;
+    /* Conversion from another precision. */
+    template <typename U>
+    explicit basic_pcomplex(const basic_pcomplex<U>& z);
+
+    operator complex() const;
 
 public:
-    dcomplex v0_;
-    dcomplex v1_;
+    complex v0_;
+    complex v1_;
 };
 
+using pcomplex = basic_pcomplex<double>;
+
+template <typename T>
 inline
-pcomplex::pcomplex(const dcomplex& numerator,
-                   const dcomplex& denominator)
+basic_pcomplex<T>::basic_pcomplex(const complex& numerator,
+                                  const complex& denominator)
     : v0_{numerator}, v1_{denominator}
 {
 }
 
+template <typename T>
 inline
-pcomplex::pcomplex(const dcomplex& value) {
+basic_pcomplex<T>::basic_pcomplex(const complex& value) {
     if (std::isinf(value.real()) || std::isinf(value.imag())) {
         v0_ = 1;
         v1_ = 0;
@@ -49,8 +62,17 @@ pcomplex::pcomplex(const dcomplex& value) {
     }
 }
 
+template <typename T>
+template <typename U>
+inline
+basic_pcomplex<T>::basic_pcomplex(const basic_pcomplex<U>& z)
+    : v0_{complex(z.v0_)}, v1_{complex(z.v1_)}
+{
+}
+
+template <typename T>
 inline
-pcomplex::operator dcomplex() const {
+basic_pcomplex<T>::operator complex() const {
     return v0_/v1_;
 }
 
@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: GPL-3.0-only
+ *
+ * Copyright 2024 Darsh Ranjan.
+ *
+ * This file is part of super-apollonian-cpp.
+ */
+
+/* Images stored as square tiles, each of which is either a single
+ * value repeated over the whole tile, or a full image_buffer.
+ *
+ * The accumulators of stolen subtrees are mostly zero, since a subtree
+ * only touches a small part of its cell, and they wait in memory until
+ * that cell is done.  Keeping them as tiled images, a uniform tile
+ * costs one pixel of memory, and adding a tile of zeros back to the
+ * image is skipped.
+ */
+#ifndef TILED_IMAGE_HPP
+#define TILED_IMAGE_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "image_buffer.hpp"
+
+namespace apollonian {
+
+template <typename Pixel>
+class tiled_image {
+public:
+    static constexpr int tile_size = 64;
+
+    /* A copy of image, keeping only the non-uniform tiles. */
+    explicit tiled_image(image_view<const Pixel> image);
+
+    /* image += *this.  The images must have the same size. */
+    void add_to(image_view<Pixel> image) const;
+
+    int rows() const;
+    int cols() const;
+
+private:
+    struct tile_data {
+    public:
+        Pixel value_;
+        std::unique_ptr<image_buffer<Pixel>> pixels_;
+    };
+
+    tile_data& get_tile(int i, int j);
+    const tile_data& get_tile(int i, int j) const;
+
+    /* The pixel rows and columns of tile (i, j) */
+    int tile_height(int i) const;
+    int tile_width(int j) const;
+
+    static bool equal(const Pixel& a, const Pixel& b);
+
+private:
+    int rows_;
+    int cols_;
+    int tile_rows_;
+    int tile_cols_;
+    std::vector<tile_data> tiles_;
+};
+
+template <typename Pixel>
+tiled_image<Pixel>::tiled_image(image_view<const Pixel> image)
+    : rows_{image.rows()}, cols_{image.cols()},
+      tile_rows_{(rows_ + tile_size - 1)/tile_size},
+      tile_cols_{(cols_ + tile_size - 1)/tile_size},
+      tiles_(tile_rows_*tile_cols_)
+{
+    for (int i = 0; i < tile_rows_; ++i) {
+        for (int j = 0; j < tile_cols_; ++j) {
+            int row0 = i*tile_size;
+            int col0 = j*tile_size;
+            int rows = tile_height(i);
+            int cols = tile_width(j);
+            Pixel value = image(row0, col0);
+            bool uniform = true;
+            for (int row = 0; row < rows && uniform; ++row) {
+                const Pixel* src = image[row0 + row] + col0;
+                for (int col = 0; col < cols && uniform; ++col) {
+                    uniform = equal(src[col], value);
+                }
+            }
+            tile_data& t = get_tile(i, j);
+            t.value_ = value;
+            if (uniform) continue;
+            t.pixels_ = std::make_unique<image_buffer<Pixel>>(rows, cols);
+            for (int row = 0; row < rows; ++row) {
+                const Pixel* src = image[row0 + row] + col0;
+                std::copy(src, src + cols, (*t.pixels_)[row]);
+            }
+        }
+    }
+}
+
+template <typename Pixel>
+void tiled_image<Pixel>::add_to(image_view<Pixel> image) const {
+    for (int i = 0; i < tile_rows_; ++i) {
+        for (int j = 0; j < tile_cols_; ++j) {
+            const tile_data& t = get_tile(i, j);
+            int row0 = i*tile_size;
+            int col0 = j*tile_size;
+            int rows = tile_height(i);
+            int cols = tile_width(j);
+            if (t.pixels_) {
+                for (int row = 0; row < rows; ++row) {
+                    const Pixel* src = (*t.pixels_)[row];
+                    Pixel* dst = image[row0 + row] + col0;
+                    for (int col = 0; col < cols; ++col) {
+                        dst[col] += src[col];
+                    }
+                }
+            } else if (!equal(t.value_, Pixel{})) {
+                for (int row = 0; row < rows; ++row) {
+                    image.add_row(t.value_, row0 + row, col0, col0 + cols);
+                }
+            }
+        }
+    }
+}
+
+template <typename Pixel>
+typename tiled_image<Pixel>::tile_data&
+tiled_image<Pixel>::get_tile(int i, int j) {
+    return tiles_[i*tile_cols_ + j];
+}
+
+template <typename Pixel>
+const typename tiled_image<Pixel>::tile_data&
+tiled_image<Pixel>::get_tile(int i, int j) const {
+    return tiles_[i*tile_cols_ + j];
+}
+
+template <typename Pixel>
+int tiled_image<Pixel>::tile_height(int i) const {
+    return std::min(tile_size, rows_ - i*tile_size);
+}
+
+template <typename Pixel>
+int tiled_image<Pixel>::tile_width(int j) const {
+    return std::min(tile_size, cols_ - j*tile_size);
+}
+
+/* Pixels are compared bitwise, which is exact for the integer colors,
+ * and only misses some uniform tiles for floating point.
+ */
+template <typename Pixel>
+bool tiled_image<Pixel>::equal(const Pixel& a, const Pixel& b) {
+    return memcmp(&a, &b, sizeof(Pixel)) == 0;
+}
+
+template <typename Pixel>
+int tiled_image<Pixel>::rows() const {
+    return rows_;
+}
+
+template <typename Pixel>
+int tiled_image<Pixel>::cols() const {
+    return cols_;
+}
+
+} // apollonian
+
+#endif // TILED_IMAGE_HPP
@@ -28,11 +28,59 @@ public:
     template <typename... Args>
     transformation_graph(Args&&... args);
 
+    /* Call f(edge) for each edge out of the given node type. */
+    template <typename F>
+    void for_each_edge(unsigned int type_index, F&& f) const;
+
 public:
     /* The adjacency list of the transformation graph. */
     std::array<std::vector<graph_edge<Transform>>, N> edges_;
 };
 
+/* Compile-time counterpart of graph_edge, for graphs whose
+ * transformations are all known in advance.  Transform is a type with
+ * a static right_multiply(t) method computing t*transform.
+ */
+template <unsigned int TypeIndex, unsigned int Id, typename Transform>
+struct static_graph_edge {
+    static constexpr unsigned int type_index = TypeIndex;
+    static constexpr unsigned int id = Id;
+    using transform = Transform;
+};
+
+template <typename... Edges>
+struct static_edge_list {
+    template <typename F>
+    static void for_each(F&& f);
+};
+
+/* Compile-time counterpart of transformation_graph.  Each template
+ * argument is the static_edge_list of one node type.  Looping over the
+ * edges of a node type is fully unrolled, with each edge passed to the
+ * callback as a distinct type.
+ */
+template <typename... EdgeLists>
+struct static_transformation_graph {
+    template <typename F>
+    static void for_each_edge(unsigned int type_index, F&& f);
+};
+
+/* t*edge.transform, for either kind of edge. */
+template <typename Transform>
+inline Transform
+right_multiply(const Transform& t, const graph_edge<Transform>& edge) {
+    return t*edge.transform;
+}
+
+template <typename T, unsigned int TypeIndex, unsigned int Id,
+          typename Transform>
+inline T
+right_multiply(const T& t,
+               const static_graph_edge<TypeIndex, Id, Transform>&)
+{
+    return Transform::right_multiply(t);
+}
+
 template <unsigned int N, typename Transform>
 template <typename... Args>
 transformation_graph<N, Transform>::transformation_graph(Args&&... args)
@@ -40,6 +88,63 @@ transformation_graph<N, Transform>::transformation_graph(Args&&... args)
 {
 }
 
+template <unsigned int N, typename Transform>
+template <typename F>
+inline void
+transformation_graph<N, Transform>::for_each_edge(unsigned int type_index,
+                                                  F&& f) const
+{
+    for (const auto& edge : edges_[type_index]) {
+        f(edge);
+    }
+}
+
+template <unsigned int TypeIndex, unsigned int Id, typename Transform>
+constexpr unsigned int
+static_graph_edge<TypeIndex, Id, Transform>::type_index;
+
+template <unsigned int TypeIndex, unsigned int Id, typename Transform>
+constexpr unsigned int
+static_graph_edge<TypeIndex, Id, Transform>::id;
+
+template <typename... Edges>
+template <typename F>
+inline void
+static_edge_list<Edges...>::for_each(F&& f) {
+    using expand = int[];
+    (void)expand{0, (f(Edges{}), 0)...};
+}
+
+template <typename... EdgeLists>
+struct static_edge_dispatch;
+
+template <>
+struct static_edge_dispatch<> {
+    template <typename F>
+    static void apply(unsigned int, F&&) {}
+};
+
+template <typename EdgeList, typename... Rest>
+struct static_edge_dispatch<EdgeList, Rest...> {
+    template <typename F>
+    static void apply(unsigned int type_index, F&& f) {
+        if (type_index == 0) {
+            EdgeList::for_each(f);
+        } else {
+            static_edge_dispatch<Rest...>::apply(type_index - 1, f);
+        }
+    }
+};
+
+template <typename... EdgeLists>
+template <typename F>
+inline void
+static_transformation_graph<EdgeLists...>::for_each_edge(
+        unsigned int type_index, F&& f)
+{
+    static_edge_dispatch<EdgeLists...>::apply(type_index, f);
+}
+
 } // apollonian
 
 #endif // TRANSFORMATION_GRAPH_HPP
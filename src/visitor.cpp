@@ -8,7 +8,9 @@
 #include "visitor.hpp"
 
 #include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <thread>
 
 namespace apollonian {
 
@@ -22,18 +24,11 @@ int rendering_visitor::rows() const {
     return renderer_.image_.rows();
 }
 
-rendering_visitor::color_data
-rendering_visitor::color_data::operator | (
-        const rendering_visitor::color_data& other) const
-{
-    return level_ >= other.level_? *this : other;
-}
-
 rendering_visitor::rendering_visitor(
     renderer&& renderer_,
     double threshold,
     const std::array<std::array<double, 4>, 3>& color_table)
-    : renderer_{renderer_}, threshold_{threshold}, count_{0},
+    : renderer_{std::move(renderer_)}, threshold_{threshold}, count_{0},
       color_table_{color_table}
 {
 }
@@ -42,7 +37,7 @@ rendering_visitor::rendering_visitor(
     renderer&& renderer_,
     double threshold,
     const std::array<rgb_color, 4>& colors)
-    : renderer_{renderer_}, threshold_{threshold}, count_{0}
+    : renderer_{std::move(renderer_)}, threshold_{threshold}, count_{0}
 {
     for (int k = 0; k < 4; ++k) {
         color_table_[0][k] = double(colors[k].r_)/0x7fffffff;
@@ -52,7 +47,7 @@ rendering_visitor::rendering_visitor(
 }
 
 rendering_visitor rendering_visitor::window(
-    int col0, int row0, int cols, int rows) const
+    int col0, int row0, int cols, int rows)
 {
     return {renderer_.window(col0, row0, cols, rows), threshold_, color_table_};
 }
@@ -81,11 +76,12 @@ rendering_visitor::set_fg(extra_data& data) const {
         rgb[k] *= g;
         rgb[k] = 1 - f + f*rgb[k];
     }
-    data.self_fg_.color_ = rgb_color(rgb[0], rgb[1], rgb[2]);
+    data.fg_ = rgb_color(rgb[0], rgb[1], rgb[2]);
 }
 
+template <typename State>
 bool
-rendering_visitor::visit_node(const state& s) {
+rendering_visitor::visit_node(const State& s) {
     if (s.data_.intersection_type_ == intersection_type::outside) {
         return false;
     }
@@ -102,27 +98,46 @@ rendering_visitor::visit_node(const state& s) {
     return false;
 }
 
+template <typename State>
 bool
-rendering_visitor::visit_node_a(const state& s) {
+rendering_visitor::visit_node_a(const State& s) {
     return s.size() >= threshold_;
 }
 
+template <typename State>
 bool
-rendering_visitor::visit_node_b(const state& s) {
-    circle c = s;
-    renderer_.render_circle(c, s.data_.self_fg_.color_, s.data_.bg_);
+rendering_visitor::visit_node_b(const State& s) {
+    renderer_.render_circle(s, s.data_.fg_, s.data_.bg_);
     ++count_;
 
     return s.size() >= threshold_;
 }
 
-rendering_visitor::extra_data
-rendering_visitor::get_data(const state& parent, node_type type,
+template <typename State>
+bool
+rendering_visitor::get_data(const State& parent, node_type type,
                             transformation_id id,
-                            const apollonian_transformation& t) const
+                            const typename State::transformation& t,
+                            const circle& c,
+                            intersection_type bounds_intersection,
+                            extra_data& data) const
 {
-    extra_data data = parent.data_;
-    circle c = t.g0_(canonical::c);
+    /* Reject everything that visit_node would reject or ignore before
+     * doing any real work.  Type-B nodes below the threshold are still
+     * drawn, so they need their colors.
+     */
+    intersection_type intersection = parent.data_.intersection_type_;
+    if (intersection == intersection_type::intersects) {
+        intersection = bounds_intersection;
+        if (intersection == intersection_type::invalid) {
+            intersection = renderer_.intersects_circle(c);
+        }
+        if (intersection == intersection_type::outside) return false;
+    }
+    if (type == node_type::A && node_size(c) < threshold_) return false;
+
+    data = parent.data_;
+    data.intersection_type_ = intersection;
 
     switch (id) {
     case transformation_id::M0:
@@ -143,74 +158,250 @@ rendering_visitor::get_data(const state& parent, node_type type,
         assert(false);
     }
 
-    if (data.intersection_type_ == intersection_type::intersects) {
-        data.intersection_type_ =
-            renderer_.intersects_circle(c);
-    }
-    if (type == node_type::B &&
-        data.intersection_type_ != intersection_type::outside)
-    {
-        ++data.self_fg_.level_;
-
+    if (type == node_type::B) {
         double r = std::abs(c.radius());
         double f = 0.25 * std::pow(1/(1/r + r)*4, 0.6);
         data.c_[t.g1_.g_.v_[3]] += f;
 
-        data.bg_ = data.self_fg_.color_;
+        data.bg_ = data.fg_;
         set_fg(data);
     }
 
-    return data;
+    return true;
+}
+
+const box&
+rendering_visitor::bounds() const {
+    return renderer_.bbox_;
 }
 
+/* Below this many pixels, the rounding errors of a single-precision
+ * traversal start to show in the image.
+ */
+static constexpr double promote_pixels = 128;
+
+double
+rendering_visitor::promote_size() const {
+    return promote_pixels/renderer_.res_;
+}
+
+/* The states that the callbacks are used with.  The double-precision
+ * state is also needed by the single-precision traversal.
+ */
+using double_state = apollonian_state<rendering_visitor::extra_data>;
+using float_state = apollonian_state<rendering_visitor::extra_data, float>;
+
+template bool rendering_visitor::visit_node(const double_state&);
+template bool rendering_visitor::visit_node(const float_state&);
+
+template bool rendering_visitor::get_data(
+    const double_state&, node_type, transformation_id,
+    const double_state::transformation&, const circle&,
+    intersection_type, extra_data&) const;
+template bool rendering_visitor::get_data(
+    const float_state&, node_type, transformation_id,
+    const float_state::transformation&, const circle&,
+    intersection_type, extra_data&) const;
+
 void
-rendering_visitor::render(const pcomplex& a,
-                          const pcomplex& b,
-                          const pcomplex& c)
+rendering_visitor::get_seed_data(extra_data& data0, extra_data& data1) const
 {
-    extra_data data0;
     data0.intersection_type_ = intersection_type::intersects;
     data0.c_[0] = 0;
     data0.c_[1] = 0;
     data0.c_[2] = 0;
     data0.c_[3] = 0.1;
     data0.bg_ = rgb_color::black;
-    data0.self_fg_.level_ = 1;
 
-    extra_data data1;
     data1.intersection_type_ = intersection_type::intersects;
     data1.c_[0] = 0;
     data1.c_[1] = 0;
     data1.c_[2] = 0;
     data1.c_[3] = 0;
     data1.bg_ = rgb_color::black;
-    data1.self_fg_.level_ = 0;
 
     set_fg(data0);
     set_fg(data1);
+}
 
-    data0.point_bg_[0] = data0.self_fg_ | data1.self_fg_;
-    data0.point_bg_[1] = data0.self_fg_ | data1.self_fg_;
-    data0.point_bg_[2] = data0.self_fg_ | data1.self_fg_;
+rendering_visitor::pixel_range
+rendering_visitor::get_range(const circle& c) const {
+    int cols = renderer_.image_.cols();
+    int rows = renderer_.image_.rows();
+    if (c.v00_ <= 0) {
+        return {0, cols, 0, rows};
+    }
 
-    data1.point_bg_[0] = data0.self_fg_ | data1.self_fg_;
-    data1.point_bg_[1] = data0.self_fg_ | data1.self_fg_;
-    data1.point_bg_[2] = data0.self_fg_ | data1.self_fg_;
+    /* Boundary pixels extend a little beyond the circle itself. */
+    double xc;
+    double yc;
+    renderer_.map(c.center(), xc, yc);
+    double r = std::abs(c.radius())*renderer_.res_ + 1;
+    return {std::max(0, int(std::floor(xc - r))),
+            std::min(cols, int(std::ceil(xc + r))),
+            std::max(0, int(std::floor(yc - r))),
+            std::min(rows, int(std::ceil(yc + r)))};
+}
 
-    generate_apollonian_gasket(a, b, c, data0, data1, *this);
+void
+rendering_visitor::render(const pcomplex& a,
+                          const pcomplex& b,
+                          const pcomplex& c)
+{
+    extra_data data0;
+    extra_data data1;
+    get_seed_data(data0, data1);
+
+    std::vector<state> stack;
+    push_apollonian_seeds(a, b, c, data0, data1, stack);
+    traverse_apollonian_gasket(stack, *this);
+    renderer_.flush();
 }
 
+/* Visitor that expands the top of the tree for a rendering_visitor
+ * without drawing anything, stopping at nodes smaller than the
+ * frontier size.
+ */
+class frontier_visitor {
+public:
+    using state = rendering_visitor::state;
+    using extra_data = rendering_visitor::extra_data;
+
+    frontier_visitor(const rendering_visitor& visitor,
+                     double frontier_size,
+                     rendering_visitor::frontier& f)
+        : visitor_{visitor}, frontier_size_{frontier_size}, frontier_{f}
+    {
+    }
+
+    template <typename State>
+    bool visit_node(const State& s) {
+        if (s.data_.intersection_type_ == intersection_type::outside) {
+            return false;
+        }
+
+        circle c = s;
+        double size = s.size();
+        if (size < frontier_size_) {
+            frontier_.nodes_.push_back({state{s}, visitor_.get_range(c)});
+            return false;
+        }
+
+        if (s.type_ == node_type::B) {
+            frontier_.circles_.push_back({c, s.data_.fg_, s.data_.bg_,
+                                          visitor_.get_range(c)});
+        }
+
+        return size >= visitor_.threshold_;
+    }
+
+    template <typename State>
+    bool get_data(const State& parent, node_type type,
+                  transformation_id id,
+                  const typename State::transformation& t,
+                  const circle& c,
+                  intersection_type bounds_intersection,
+                  extra_data& data) const
+    {
+        return visitor_.get_data(parent, type, id, t, c,
+                                 bounds_intersection, data);
+    }
+
+    const box& bounds() const {
+        return visitor_.bounds();
+    }
+
+    /* Never promote: everything visited here is at least the frontier
+     * size, except for the frontier nodes themselves, which are kept in
+     * the precision of state and promoted in the cells, exactly as in
+     * a traversal of the whole image.
+     */
+    double promote_size() const {
+        return 0;
+    }
+
+private:
+    const rendering_visitor& visitor_;
+    double frontier_size_;
+    rendering_visitor::frontier& frontier_;
+};
+
 void
-rendering_visitor::render_window(
+rendering_visitor::expand_frontier(
     const pcomplex& a, const pcomplex& b, const pcomplex& c,
-    int col0, int row0, int cols, int rows, std::mutex& mutex)
+    double frontier_size, frontier& f) const
 {
-    rendering_visitor visitor = window(col0, row0, cols, rows);
-    visitor.render(a, b, c);
-    std::unique_lock<std::mutex> lock(mutex);
-    std::cout << "(" << col0 << ", " << row0 << ") ";
-    visitor.report();
-    renderer_.set_window(col0, row0, visitor.renderer_);
+    extra_data data0;
+    extra_data data1;
+    get_seed_data(data0, data1);
+
+    frontier_visitor visitor{*this, frontier_size, f};
+    std::vector<state> stack;
+    push_apollonian_seeds(a, b, c, data0, data1, stack);
+    traverse_apollonian_gasket(stack, visitor);
+}
+
+void
+rendering_visitor::seed_window(const frontier& f, const frontier_cell& cell,
+                               std::vector<state>& stack)
+{
+    /* The frontier is in traversal order, so every circle here is
+     * drawn before any of its descendants.
+     */
+    for (int k : cell.circles_) {
+        const frontier::circle_record& record = f.circles_[k];
+        renderer_.render_circle(record.circle_, record.new_color_,
+                                record.old_color_);
+        ++count_;
+    }
+
+    /* The frontier nodes were culled against the whole image, so redo
+     * that against this window.
+     */
+    for (int k : cell.nodes_) {
+        stack.push_back(f.nodes_[k].state_);
+        state& s = stack.back();
+        s.data_.intersection_type_ = renderer_.intersects_circle(s);
+    }
+}
+
+template <typename State>
+void
+rendering_visitor::traverse(std::vector<State>& stack,
+                            steal_point_type& point, int tag,
+                            std::atomic<int>* loot_count)
+{
+    point.open(tag, loot_count);
+    traverse_apollonian_gasket(stack, *this,
+                               [&point](auto& s) { point.poll(s); });
+    renderer_.flush();
+    point.close();
+}
+
+rendering_visitor
+rendering_visitor::accumulator(int col0, int row0, int cols, int rows) const
+{
+    return {renderer_.accumulator(col0, row0, cols, rows),
+            threshold_, color_table_};
+}
+
+void
+rendering_visitor::add_window(int col0, int row0,
+                              const rendering_visitor& window)
+{
+    renderer_.add_window(col0, row0, window.renderer_);
+}
+
+void
+rendering_visitor::add_window(int col0, int row0,
+                              const tiled_image<rgb_color>& window)
+{
+    renderer_.add_window(col0, row0, window);
+}
+
+void
+rendering_visitor::set_fill_mode(fill_mode mode) {
+    renderer_.set_fill_mode(mode);
 }
 
 void
@@ -218,24 +409,230 @@ rendering_visitor::report() const {
     std::cout << "Circles rendered: " << count_ << std::endl;
 }
 
+/* Enough for the deepest traversals at 4K. */
+static constexpr std::size_t initial_stack_size = 1 << 14;
+
 rendering_grid::rendering_grid(
     int num_threads,
     const pcomplex& z0,
     const pcomplex& z1,
     const pcomplex& z2,
     int cols, int rows,
-    rendering_visitor& visitor)
+    double frontier_size,
+    rendering_visitor& visitor,
+    const filter_pipeline* filters,
+    const storage_options& filtered_storage)
     : grid_dispatch(num_threads, visitor.cols(), visitor.rows(), cols, rows),
       z0_{z0}, z1_{z1}, z2_{z2},
-      visitor_{&visitor}
+      grid_cols_{(visitor.cols() + cols - 1)/cols},
+      frontier_size_{frontier_size},
+      visitor_{&visitor},
+      stacks_(num_threads),
+#if defined(APOLLONIAN_MIXED_PRECISION)
+      promoted_stacks_(num_threads),
+#endif
+      steal_points_(num_threads),
+      filters_{filters},
+      filtered_storage_{filtered_storage},
+      filtered_{0, 0},
+      tile_cols_{0}
 {
+    for (auto& stack : stacks_) stack.reserve(initial_stack_size);
 }
 
-void rendering_grid::run_cell(int col0, int row0, int cols, int rows,
+void rendering_grid::prepare() {
+    int grid_rows = (visitor_->rows() + cell_rows() - 1)/cell_rows();
+
+    frontier_ = {};
+    cells_.assign(grid_cols_*grid_rows, {});
+    /* Tiled images can't be copied. */
+    stolen_.clear();
+    stolen_.resize(grid_cols_*grid_rows);
+    outstanding_.reset(new std::atomic<int>[grid_cols_*grid_rows]());
+    if (filters_) prepare_filters();
+    visitor_->expand_frontier(z0_, z1_, z2_, frontier_size_, frontier_);
+
+    /* Calls f(cell) for every cell overlapping the pixel range. */
+    auto for_cells = [this](const rendering_visitor::pixel_range& range,
+                            auto f)
+    {
+        if (range.col_end_ <= range.col_begin_) return;
+        if (range.row_end_ <= range.row_begin_) return;
+        int i0 = range.row_begin_/cell_rows();
+        int i1 = (range.row_end_ - 1)/cell_rows();
+        int j0 = range.col_begin_/cell_cols();
+        int j1 = (range.col_end_ - 1)/cell_cols();
+        for (int i = i0; i <= i1; ++i) {
+            for (int j = j0; j <= j1; ++j) {
+                f(cells_[i*grid_cols_ + j]);
+            }
+        }
+    };
+
+    int num_circles = frontier_.circles_.size();
+    for (int k = 0; k < num_circles; ++k) {
+        for_cells(frontier_.circles_[k].range_,
+                  [k](rendering_visitor::frontier_cell& cell) {
+                      cell.circles_.push_back(k);
+                  });
+    }
+
+    int num_nodes = frontier_.nodes_.size();
+    for (int k = 0; k < num_nodes; ++k) {
+        for_cells(frontier_.nodes_[k].range_,
+                  [k](rendering_visitor::frontier_cell& cell) {
+                      cell.nodes_.push_back(k);
+                  });
+    }
+
+    std::cout << "Frontier: " << num_circles << " circles, "
+              << num_nodes << " subtrees" << std::endl;
+}
+
+void rendering_grid::prepare_filters() {
+    int grid_rows = (visitor_->rows() + cell_rows() - 1)/cell_rows();
+    int rows = filters_->output_size(visitor_->rows());
+    int cols = filters_->output_size(visitor_->cols());
+    int tile_size = filters_->tile_size();
+    int tile_rows = (rows + tile_size - 1)/tile_size;
+
+    filtered_ = image_buffer<rgb_color>(rows, cols, filtered_storage_);
+    tile_cols_ = (cols + tile_size - 1)/tile_size;
+    tile_waits_.assign(tile_rows*tile_cols_, 0);
+    cell_tiles_.assign(grid_cols_*grid_rows, {});
+    for (int t = 0; t < tile_rows*tile_cols_; ++t) {
+        int row0 = (t/tile_cols_)*tile_size;
+        int col0 = (t % tile_cols_)*tile_size;
+        int row1 = std::min(rows, row0 + tile_size);
+        int col1 = std::min(cols, col0 + tile_size);
+        filters_->input_rect(row0, row1, col0, col1);
+        for (int i = row0/cell_rows(); i <= (row1 - 1)/cell_rows(); ++i) {
+            for (int j = col0/cell_cols(); j <= (col1 - 1)/cell_cols(); ++j) {
+                ++tile_waits_[t];
+                cell_tiles_[i*grid_cols_ + j].push_back(t);
+            }
+        }
+    }
+}
+
+void rendering_grid::run_cell(int worker,
+                              int col0, int row0, int cols, int rows,
                               std::mutex& run_mutex)
 {
-    visitor_->render_window(
-        z0_, z1_, z2_, col0, row0, cols, rows, run_mutex);
+    int index = (row0/cell_rows())*grid_cols_ + col0/cell_cols();
+    rendering_visitor visitor = visitor_->window(col0, row0, cols, rows);
+    std::vector<rendering_visitor::state>& stack = stacks_[worker];
+    visitor.set_fill_mode(fill_mode::difference);
+    visitor.seed_window(frontier_, cells_[index], stack);
+    visitor.traverse(stack, steal_points_[worker], index,
+                     &outstanding_[index]);
+    visitor.set_fill_mode(fill_mode::replace);
+    filter_tiles(commit(index, std::move(visitor), false, run_mutex));
+}
+
+void rendering_grid::run_idle(int worker, std::mutex& run_mutex) {
+    int num_threads = steal_points_.size();
+    std::vector<rendering_visitor::state>& stack = stacks_[worker];
+#if defined(APOLLONIAN_MIXED_PRECISION)
+    std::vector<rendering_visitor::promoted_state>& promoted =
+        promoted_stacks_[worker];
+#endif
+
+    for (;;) {
+        int index = 0;
+        bool stolen = false;
+        bool busy = false;
+        for (int k = 1; k < num_threads && !stolen; ++k) {
+            auto& victim = steal_points_[(worker + k) % num_threads];
+#if defined(APOLLONIAN_MIXED_PRECISION)
+            stolen = victim.steal(index, stack, promoted);
+#else
+            stolen = victim.steal(index, stack);
+#endif
+            busy = busy || victim.is_open();
+        }
+
+        if (stolen) {
+            int col0 = (index % grid_cols_)*cell_cols();
+            int row0 = (index / grid_cols_)*cell_rows();
+            rendering_visitor visitor = visitor_->accumulator(
+                col0, row0, cell_cols(), cell_rows());
+            visitor.set_fill_mode(fill_mode::difference);
+            visitor.traverse(stack, steal_points_[worker], index,
+                             &outstanding_[index]);
+#if defined(APOLLONIAN_MIXED_PRECISION)
+            visitor.traverse(promoted, steal_points_[worker], index,
+                             &outstanding_[index]);
+#endif
+            visitor.set_fill_mode(fill_mode::add);
+            filter_tiles(commit(index, std::move(visitor), true, run_mutex));
+        } else if (busy) {
+            std::this_thread::yield();
+        } else {
+            return;
+        }
+    }
+}
+
+std::vector<int>
+rendering_grid::commit(int index, rendering_visitor&& visitor,
+                       bool stolen, std::mutex& run_mutex)
+{
+    int col0 = (index % grid_cols_)*cell_cols();
+    int row0 = (index / grid_cols_)*cell_rows();
+
+    std::unique_lock<std::mutex> lock(run_mutex);
+    std::cout << "(" << col0 << ", " << row0 << ") ";
+    if (stolen) std::cout << "stolen ";
+    visitor.report();
+
+    /* The cell's own window has drawn directly into the image.
+     * Accumulators only hold differences, so they can be added in any
+     * order, but only after the cell itself is done.
+     */
+    stolen_tiles& cell = stolen_[index];
+    if (!stolen) {
+        cell.committed_ = true;
+        for (const auto& tile : cell.tiles_) {
+            visitor_->add_window(col0, row0, tile);
+        }
+        cell.tiles_.clear();
+    } else {
+        --outstanding_[index];
+        if (cell.committed_) {
+            visitor_->add_window(col0, row0, visitor);
+        } else {
+            cell.tiles_.emplace_back(visitor.buffer());
+        }
+    }
+
+    /* Every subtree stolen from the cell was counted before the thread
+     * it was stolen from could commit, so nothing can still be drawing
+     * into a cell that gets here.
+     */
+    std::vector<int> ready;
+    if (filters_ && cell.committed_ && outstanding_[index] == 0) {
+        for (int t : cell_tiles_[index]) {
+            if (--tile_waits_[t] == 0) ready.push_back(t);
+        }
+    }
+    return ready;
+}
+
+void rendering_grid::filter_tiles(const std::vector<int>& tiles) {
+    int tile_size = filters_->tile_size();
+    for (int t : tiles) {
+        int row0 = (t/tile_cols_)*tile_size;
+        int col0 = (t % tile_cols_)*tile_size;
+        int row1 = std::min(filtered_.rows(), row0 + tile_size);
+        int col1 = std::min(filtered_.cols(), col0 + tile_size);
+        filters_->apply_rect(visitor_->buffer(), filtered_,
+                             row0, row1, col0, col1);
+    }
+}
+
+const image_buffer<rgb_color>& rendering_grid::filtered() const {
+    return filtered_;
 }
 
 } // apollonian
@@ -8,7 +8,12 @@
 #ifndef VISITOR_HPP
 #define VISITOR_HPP
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
 #include "concurrency.hpp"
+#include "filter_pipeline.hpp"
 #include "riemann_sphere.hpp"
 #include "apollonian.hpp"
 #include "render.hpp"
@@ -19,28 +24,85 @@ namespace apollonian {
  */
 class rendering_visitor {
 public:
-    struct color_data {
-    public:
-        rgb_color color_;
-        int level_;
-
-        color_data operator | (const color_data& other) const;
-    };
-
+    /* This is copied for every node on the traversal stack, so it is
+     * kept small, with the members ordered to avoid padding.
+     */
     struct extra_data {
     public:
         extra_data() = default;
         extra_data(const extra_data&) = default;
+        extra_data& operator = (const extra_data&) = default;
 
     public:
-        intersection_type intersection_type_;
         std::array<double, 4> c_;
         rgb_color bg_;
-        color_data self_fg_;
-        std::array<color_data, 3> point_bg_;
+        rgb_color fg_;
+        intersection_type intersection_type_;
     };
 
+    /* The precision of the traversal, selected by the "precision"
+     * build option.  See traverse_apollonian_gasket for the
+     * single-precision traversal.
+     */
+#if defined(APOLLONIAN_MIXED_PRECISION)
+    using state = apollonian_state<extra_data, float>;
+    using promoted_state = apollonian_state<extra_data>;
+#else
     using state = apollonian_state<extra_data>;
+#endif
+
+    /* With mixed precision, the subtrees promoted to double precision
+     * can be stolen as well, in their own precision.
+     */
+#if defined(APOLLONIAN_MIXED_PRECISION)
+    using steal_point_type = steal_point<state, promoted_state>;
+#else
+    using steal_point_type = steal_point<state>;
+#endif
+
+    /* Half-open range of pixels that a node can affect. */
+    struct pixel_range {
+    public:
+        int col_begin_;
+        int col_end_;
+        int row_begin_;
+        int row_end_;
+    };
+
+    /* The top of the traversal tree, expanded once for the whole image
+     * and shared by all cells.  The circles above the frontier are
+     * recorded in traversal order so that each cell can replay the ones
+     * it touches, and the nodes on the frontier are the roots of the
+     * subtrees that each cell traverses by itself.
+     */
+    struct frontier {
+    public:
+        struct circle_record {
+        public:
+            circle circle_;
+            rgb_color new_color_;
+            rgb_color old_color_;
+            pixel_range range_;
+        };
+
+        struct node_record {
+        public:
+            state state_;
+            pixel_range range_;
+        };
+
+        std::vector<circle_record> circles_;
+        std::vector<node_record> nodes_;
+    };
+
+    /* The parts of a frontier relevant to one cell, as indices into
+     * frontier::circles_ and frontier::nodes_.
+     */
+    struct frontier_cell {
+    public:
+        std::vector<int> circles_;
+        std::vector<int> nodes_;
+    };
 
 public:
     rendering_visitor(renderer&& renderer_,
@@ -50,18 +112,59 @@ public:
                       double threshold,
                       const std::array<rgb_color, 4>& colors);
 
-    rendering_visitor window(int col0, int row0, int cols, int rows) const;
+    /* See renderer::window. */
+    rendering_visitor window(int col0, int row0, int cols, int rows);
 
-    /* Callbacks */
-    bool visit_node(const state& s);
-    extra_data get_data(const state& parent, node_type type,
-                        canonical::transformation_id id,
-                        const apollonian_transformation& t) const;
+    /* Callbacks, for state and also for the double-precision state
+     * that a single-precision traversal promotes to.
+     */
+    template <typename State>
+    bool visit_node(const State& s);
+    template <typename State>
+    bool get_data(const State& parent, node_type type,
+                  canonical::transformation_id id,
+                  const typename State::transformation& t,
+                  const circle& c,
+                  intersection_type bounds_intersection,
+                  extra_data& data) const;
+    const box& bounds() const;
+    double promote_size() const;
 
     void render(const pcomplex& a, const pcomplex& b, const pcomplex& c);
-    void render_window(const pcomplex& a, const pcomplex& b, const pcomplex& c,
-                       int col0, int row0, int cols, int rows,
-                       std::mutex& mutex);
+
+    /* Expand every node no smaller than frontier_size (in the same
+     * units as the threshold) and collect the result into f.
+     */
+    void expand_frontier(const pcomplex& a, const pcomplex& b,
+                         const pcomplex& c, double frontier_size,
+                         frontier& f) const;
+
+    /* Draw the frontier circles of a cell and push its subtrees onto
+     * the stack.  This should be called on the cell's window.
+     */
+    void seed_window(const frontier& f, const frontier_cell& cell,
+                     std::vector<state>& stack);
+
+    /* Traverse everything on the stack, letting other threads steal
+     * from it through the given point.  See steal_point::open for the
+     * tag and loot_count.  The stack is of state, or of any of the
+     * other types of the point.
+     */
+    template <typename State>
+    void traverse(std::vector<State>& stack, steal_point_type& point,
+                  int tag, std::atomic<int>* loot_count = nullptr);
+
+    /* A blank window drawing only the changes from its subtrees.  See
+     * renderer::accumulator.
+     */
+    rendering_visitor accumulator(int col0, int row0,
+                                  int cols, int rows) const;
+
+    void add_window(int col0, int row0, const rendering_visitor& window);
+    void add_window(int col0, int row0, const tiled_image<rgb_color>& window);
+
+    /* See renderer::set_fill_mode. */
+    void set_fill_mode(fill_mode mode);
 
     void report() const;
 
@@ -69,16 +172,22 @@ public:
     int rows() const;
 
     const image_buffer<rgb_color>& buffer() const {
-        return renderer_.image_;
+        return renderer_.buffer_;
     }
 
 protected:
-    bool visit_node_a(const state& s);
-    bool visit_node_b(const state& s);
+    template <typename State>
+    bool visit_node_a(const State& s);
+    template <typename State>
+    bool visit_node_b(const State& s);
 
     void set_fg(extra_data& extra) const;
+    void get_seed_data(extra_data& data0, extra_data& data1) const;
+    pixel_range get_range(const circle& c) const;
 
 private:
+    friend class frontier_visitor;
+
     renderer renderer_;
     double threshold_;
     int count_;
@@ -90,6 +199,10 @@ private:
 /* Top-level logic: multithreaded rendering implementation.
  * Wraps a rendering_visitor object with logic to subdivide the image
  * into subcells and render multiple cells in parallel.
+ *
+ * Given a filter pipeline, the workers also filter each tile of the
+ * output as soon as every cell under it is final, while other cells
+ * are still being rendered.
  */
 class rendering_grid : public grid_dispatch {
 public:
@@ -99,19 +212,89 @@ public:
         const pcomplex& z1,
         const pcomplex& z2,
         int cols, int rows,  /* Cell dimensions. */
-        rendering_visitor& visitor);
+        double frontier_size,  /* Nodes smaller than this are expanded
+                                * separately in each cell they touch.
+                                * HUGE_VAL expands everything per cell.
+                                */
+        rendering_visitor& visitor,
+        const filter_pipeline* filters = nullptr,
+        const storage_options& filtered_storage = {});
+
+    /* The filtered image, once run() is done.  Only used with filters.
+     * Its pixels are kept as filtered_storage says, which for a large
+     * image should match the storage of the rendered image.
+     */
+    const image_buffer<rgb_color>& filtered() const;
 
 protected:
-    virtual void run_cell(int col0, int row0, int cols, int rows,
+    virtual void prepare() override;
+    void prepare_filters();
+    virtual void run_cell(int worker,
+                          int col0, int row0, int cols, int rows,
                           std::mutex& run_mutex) override;
 
+    /* Help the remaining busy threads by stealing parts of their
+     * subtrees, which are drawn into accumulators and added to the
+     * image once the cell they were stolen from is done.
+     */
+    virtual void run_idle(int worker, std::mutex& run_mutex) override;
+
+private:
+    /* Accumulators waiting for the window of their cell.  These are
+     * mostly zero, so they are kept as tiled images, which hold only
+     * the tiles that were drawn into.
+     */
+    struct stolen_tiles {
+    public:
+        bool committed_ = false;
+        std::vector<tiled_image<rgb_color>> tiles_;
+    };
+
+    /* Returns the filter tiles that became ready. */
+    std::vector<int> commit(int index, rendering_visitor&& visitor,
+                            bool stolen, std::mutex& run_mutex);
+
+    void filter_tiles(const std::vector<int>& tiles);
+
 private:
     /* Constants */
     pcomplex z0_;
     pcomplex z1_;
     pcomplex z2_;
+    int grid_cols_;
+    double frontier_size_;
 
     rendering_visitor* visitor_;
+
+    rendering_visitor::frontier frontier_;
+    std::vector<rendering_visitor::frontier_cell> cells_;
+
+    /* Per-thread traversal stacks, reused for every cell so that the
+     * memory stays allocated and warm.
+     */
+    std::vector<std::vector<rendering_visitor::state>> stacks_;
+#if defined(APOLLONIAN_MIXED_PRECISION)
+    std::vector<std::vector<rendering_visitor::promoted_state>>
+        promoted_stacks_;
+#endif
+    std::vector<rendering_visitor::steal_point_type> steal_points_;
+    std::vector<stolen_tiles> stolen_;
+
+    /* Stolen subtrees of each cell not yet committed.  A cell is final
+     * once it is committed itself and this drops to zero.
+     */
+    std::unique_ptr<std::atomic<int>[]> outstanding_;
+
+    const filter_pipeline* filters_;
+    storage_options filtered_storage_;
+    image_buffer<rgb_color> filtered_;
+    int tile_cols_;
+
+    /* For each filter tile, the cells under it that aren't final yet,
+     * and for each cell, the tiles over it.
+     */
+    std::vector<int> tile_waits_;
+    std::vector<std::vector<int>> cell_tiles_;
 };
 
 } // apollonian